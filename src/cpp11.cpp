@@ -13,17 +13,17 @@ extern "C" SEXP _palettizer_plt_check_(SEXP path) {
   END_CPP11
 }
 // plt_tize.cpp
-cpp11::writable::strings plt_tize_(const std::string& source_path, int cluster_count_init, int seed, const std::string& sort_type);
-extern "C" SEXP _palettizer_plt_tize_(SEXP source_path, SEXP cluster_count_init, SEXP seed, SEXP sort_type) {
+cpp11::writable::strings plt_tize_(const std::string& source_path, int cluster_count_init, int seed, const std::string& sort_type, const std::string& method, const std::string& init, cpp11::strings init_colors, cpp11::doubles init_cielab, int init_candidates, int alpha_threshold, bool weight_by_alpha, int n_init, int batch_size, int max_dim, int sample_size, const std::string& sampling, bool pyramid, int threads, int max_iter, double tol, double change_tol, const std::string& precision, int coreset_size, bool auto_cluster_count, const std::string& k_criterion);
+extern "C" SEXP _palettizer_plt_tize_(SEXP source_path, SEXP cluster_count_init, SEXP seed, SEXP sort_type, SEXP method, SEXP init, SEXP init_colors, SEXP init_cielab, SEXP init_candidates, SEXP alpha_threshold, SEXP weight_by_alpha, SEXP n_init, SEXP batch_size, SEXP max_dim, SEXP sample_size, SEXP sampling, SEXP pyramid, SEXP threads, SEXP max_iter, SEXP tol, SEXP change_tol, SEXP precision, SEXP coreset_size, SEXP auto_cluster_count, SEXP k_criterion) {
   BEGIN_CPP11
-    return cpp11::as_sexp(plt_tize_(cpp11::as_cpp<cpp11::decay_t<const std::string&>>(source_path), cpp11::as_cpp<cpp11::decay_t<int>>(cluster_count_init), cpp11::as_cpp<cpp11::decay_t<int>>(seed), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(sort_type)));
+    return cpp11::as_sexp(plt_tize_(cpp11::as_cpp<cpp11::decay_t<const std::string&>>(source_path), cpp11::as_cpp<cpp11::decay_t<int>>(cluster_count_init), cpp11::as_cpp<cpp11::decay_t<int>>(seed), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(sort_type), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(method), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(init), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(init_colors), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(init_cielab), cpp11::as_cpp<cpp11::decay_t<int>>(init_candidates), cpp11::as_cpp<cpp11::decay_t<int>>(alpha_threshold), cpp11::as_cpp<cpp11::decay_t<bool>>(weight_by_alpha), cpp11::as_cpp<cpp11::decay_t<int>>(n_init), cpp11::as_cpp<cpp11::decay_t<int>>(batch_size), cpp11::as_cpp<cpp11::decay_t<int>>(max_dim), cpp11::as_cpp<cpp11::decay_t<int>>(sample_size), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(sampling), cpp11::as_cpp<cpp11::decay_t<bool>>(pyramid), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<int>>(max_iter), cpp11::as_cpp<cpp11::decay_t<double>>(tol), cpp11::as_cpp<cpp11::decay_t<double>>(change_tol), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(coreset_size), cpp11::as_cpp<cpp11::decay_t<bool>>(auto_cluster_count), cpp11::as_cpp<cpp11::decay_t<const std::string&>>(k_criterion)));
   END_CPP11
 }
 
 extern "C" {
 static const R_CallMethodDef CallEntries[] = {
     {"_palettizer_plt_check_", (DL_FUNC) &_palettizer_plt_check_, 1},
-    {"_palettizer_plt_tize_",  (DL_FUNC) &_palettizer_plt_tize_,  4},
+    {"_palettizer_plt_tize_",  (DL_FUNC) &_palettizer_plt_tize_,  25},
     {NULL, NULL, 0}
 };
 }
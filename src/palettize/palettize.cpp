@@ -27,10 +27,14 @@
 #include <stdlib.h>
 #include <time.h>
 
+#ifdef _MSC_VER
 #pragma warning(push, 0)
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#ifdef _MSC_VER
 #pragma warning(pop)
+#endif
 
 #include "palettize.h"
 
@@ -39,20 +43,211 @@ static const int MAX_BITMAP_DIM = 100;
 static const int PALETTE_BITMAP_WIDTH = 512;
 static const int PALETTE_BITMAP_HEIGHT = 64;
 
+// Parses a comma-separated list of hex colors, or of L, a and b triples with
+// is_cielab, into config->initial_centroids
+static bool parse_initial_centroids(Palettize_Config *config, char *value, bool is_cielab) {
+	int capacity = 1;
+	for (char *c = value; *c; c++) {
+		if (*c == ',') capacity++;
+	}
+
+	Vector3 *centroids = (Vector3 *)malloc(sizeof(Vector3)*capacity);
+	int count = 0;
+	const char *at = value;
+	for (;;) {
+		if (is_cielab) {
+			float lab[3];
+			for (int i = 0; i < 3; i++) {
+				char *end;
+				lab[i] = strtof(at, &end);
+				if (end == at || (i < 2 && *end != ',')) {
+					free(centroids);
+					return false;
+				}
+				at = (i < 2) ? end + 1 : end;
+			}
+			centroids[count++] = V3(lab[0], lab[1], lab[2]);
+		} else {
+			u32 color;
+			at = parse_hex_color(at, &color);
+			if (!at) {
+				free(centroids);
+				return false;
+			}
+			centroids[count++] = unpack_rgba_to_cielab(color);
+		}
+
+		if (*at != ',') break;
+		at++;
+	}
+	if (*at) {
+		free(centroids);
+		return false;
+	}
+
+	free(config->initial_centroids);
+	config->initial_centroids = centroids;
+	config->initial_centroid_count = count;
+	config->seed_method = SEED_METHOD_PALETTE;
+
+	return true;
+}
+
+static void parse_option(Palettize_Config *config, int *max_cluster_count, char *name, char *value) {
+	if (strings_match(name, "method")) {
+		if (strings_match(value, "lloyd", false)) {
+			config->method = CLUSTER_METHOD_LLOYD;
+		} else if (strings_match(value, "hamerly", false)) {
+			config->method = CLUSTER_METHOD_HAMERLY;
+		} else if (strings_match(value, "elkan", false)) {
+			config->method = CLUSTER_METHOD_ELKAN;
+		} else if (strings_match(value, "yinyang", false)) {
+			config->method = CLUSTER_METHOD_YINYANG;
+		} else if (strings_match(value, "minibatch", false)) {
+			config->method = CLUSTER_METHOD_MINIBATCH;
+		} else if (strings_match(value, "kdtree", false)) {
+			config->method = CLUSTER_METHOD_KDTREE;
+		} else if (strings_match(value, "wu", false)) {
+			config->method = CLUSTER_METHOD_WU;
+		} else if (strings_match(value, "octree", false)) {
+			config->method = CLUSTER_METHOD_OCTREE;
+		} else if (strings_match(value, "bisecting", false)) {
+			config->method = CLUSTER_METHOD_BISECTING;
+		}
+	} else if (strings_match(name, "init")) {
+		if (strings_match(value, "random", false)) {
+			config->seed_method = SEED_METHOD_RANDOM;
+		} else if (strings_match(value, "kmeans++", false)) {
+			config->seed_method = SEED_METHOD_KMEANS_PLUS_PLUS;
+		} else if (strings_match(value, "greedy-kmeans++", false)) {
+			config->seed_method = SEED_METHOD_GREEDY_KMEANS_PLUS_PLUS;
+		} else if (strings_match(value, "wu", false)) {
+			config->seed_method = SEED_METHOD_WU;
+		} else if (strings_match(value, "median-cut", false)) {
+			config->seed_method = SEED_METHOD_MEDIAN_CUT;
+		} else if (!parse_initial_centroids(config, value, false)) {
+			fprintf(stderr, "Ignoring --init=%s, which is neither a method nor a list of hex colors\n", value);
+		}
+	} else if (strings_match(name, "init-lab")) {
+		if (!parse_initial_centroids(config, value, true)) {
+			fprintf(stderr, "Ignoring --init-lab=%s, which isn't a list of L, a and b triples\n", value);
+		}
+	} else if (strings_match(name, "alpha-threshold")) {
+		config->alpha_threshold = clampi(0, atoi(value), 255);
+	} else if (strings_match(name, "weight-by-alpha")) {
+		config->weight_by_alpha = !strings_match(value, "false", false) && !strings_match(value, "0");
+	} else if (strings_match(name, "init-candidates")) {
+		config->seed_candidates = maximum(0, atoi(value));
+	} else if (strings_match(name, "n-init")) {
+		config->restart_count = maximum(1, atoi(value));
+	} else if (strings_match(name, "batch-size")) {
+		config->batch_size = maximum(1, atoi(value));
+	} else if (strings_match(name, "max-dim")) {
+		config->max_dim = maximum(0, atoi(value));
+	} else if (strings_match(name, "sample-size")) {
+		config->sample_size = maximum(0, atoi(value));
+	} else if (strings_match(name, "sampling")) {
+		if (strings_match(value, "grid", false)) {
+			config->sample_pattern = SAMPLE_PATTERN_GRID;
+		} else if (strings_match(value, "stratified", false)) {
+			config->sample_pattern = SAMPLE_PATTERN_STRATIFIED;
+		} else if (strings_match(value, "halton", false)) {
+			config->sample_pattern = SAMPLE_PATTERN_HALTON;
+		}
+	} else if (strings_match(name, "pyramid")) {
+		config->pyramid = !strings_match(value, "false", false) && !strings_match(value, "0");
+	} else if (strings_match(name, "threads")) {
+		config->thread_count = maximum(0, atoi(value));
+	} else if (strings_match(name, "max-iter")) {
+		config->max_iterations = maximum(1, atoi(value));
+	} else if (strings_match(name, "tol")) {
+		config->tolerance = maximum(0.0f, (float)atof(value));
+	} else if (strings_match(name, "change-tol")) {
+		config->min_change_fraction = clamp01((float)atof(value));
+	} else if (strings_match(name, "precision")) {
+		if (strings_match(value, "float", false)) {
+			config->fixed_point = false;
+		} else if (strings_match(value, "fixed", false)) {
+			config->fixed_point = true;
+		}
+	} else if (strings_match(name, "coreset-size")) {
+		config->coreset_size = maximum(0, atoi(value));
+	} else if (strings_match(name, "k-max")) {
+		*max_cluster_count = clampi(1, atoi(value), MAX_CLUSTER_COUNT);
+	} else if (strings_match(name, "k-criterion")) {
+		if (strings_match(value, "elbow", false)) {
+			config->count_criterion = COUNT_CRITERION_ELBOW;
+		} else if (strings_match(value, "silhouette", false)) {
+			config->count_criterion = COUNT_CRITERION_SILHOUETTE;
+		} else if (strings_match(value, "bic", false)) {
+			config->count_criterion = COUNT_CRITERION_BIC;
+		}
+	} else {
+		fprintf(stderr, "Ignoring unknown option --%s\n", name);
+	}
+}
+
 static Palettize_Config parse_config_from_command_line(int argc, char **argv) {
 	Palettize_Config config = {};
 	config.source_path = 0;
 	config.cluster_count = 5;
 	config.seed = (u32)time(0);
 	config.sort_type = SORT_TYPE_WEIGHT;
+	config.method = CLUSTER_METHOD_LLOYD;
+	config.seed_method = SEED_METHOD_RANDOM;
+	config.seed_candidates = 0;
+	config.initial_centroids = 0;
+	config.initial_centroid_count = 0;
+	config.alpha_threshold = 1;
+	config.weight_by_alpha = false;
+	config.restart_count = 1;
+	config.batch_size = 1024;
+	config.max_dim = MAX_BITMAP_DIM;
+	config.sample_size = 0;
+	config.sample_pattern = SAMPLE_PATTERN_STRATIFIED;
+	config.pyramid = false;
+	config.thread_count = 1;
+	config.max_iterations = 300;
+	config.tolerance = 0.0f;
+	config.min_change_fraction = 0.0f;
+	config.fixed_point = false;
+	config.coreset_size = 0;
+	config.auto_cluster_count = false;
+	config.count_criterion = COUNT_CRITERION_ELBOW;
 	config.dest_path = "palette.bmp";
 
+	// Only used when the cluster count is "auto"
+	int max_cluster_count = 16;
+
+	// Options are given as --name=value and may appear anywhere; everything
+	// else is positional
+	int positional_argc = 1;
+	for (int i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (arg[0] == '-' && arg[1] == '-') {
+			char *name = arg + 2;
+			char *value = name;
+			while (*value && *value != '=') value++;
+			if (*value) *value++ = '\0';
+
+			parse_option(&config, &max_cluster_count, name, value);
+		} else {
+			argv[positional_argc++] = arg;
+		}
+	}
+	argc = positional_argc;
+
 	if (argc > 1) {
 		config.source_path = argv[1];
 	}
 	if (argc > 2) {
-		int cluster_count = atoi(argv[2]);
-		config.cluster_count = clampi(1, cluster_count, 64);
+		if (strings_match(argv[2], "auto", false)) {
+			config.auto_cluster_count = true;
+			config.cluster_count = max_cluster_count;
+		} else {
+			int cluster_count = atoi(argv[2]);
+			config.cluster_count = clampi(1, cluster_count, MAX_CLUSTER_COUNT);
+		}
 	}
 	if (argc > 3) {
 		config.seed = (u32)atoi(argv[3]);
@@ -74,7 +269,7 @@ static Palettize_Config parse_config_from_command_line(int argc, char **argv) {
 	return config;
 }
 
-static void load_bitmap(Bitmap *bitmap, char *path) {
+static void load_bitmap(Bitmap *bitmap, const char *path) {
 	bitmap->memory = stbi_load(path, &bitmap->width, &bitmap->height, 0, STBI_rgb_alpha);
 	if (!bitmap->memory) {
 		fprintf(stderr, "stb_image failed to load %s: %s\n", path, stbi_failure_reason());
@@ -91,161 +286,7 @@ static void allocate_bitmap(Bitmap *bitmap, int width, int height) {
 	bitmap->pitch = sizeof(u32)*width;
 }
 
-static void free_bitmap(Bitmap *bitmap) {
-	free(bitmap->memory);
-	bitmap->memory = 0;
-}
-
-static void resize_bitmap(Bitmap *bitmap, int max_dim) {
-	float resize_factor = (float)max_dim / (float)maximum(bitmap->width, bitmap->height);
-
-	Bitmap resized_bitmap;
-	allocate_bitmap(&resized_bitmap,
-					roundi(bitmap->width*resize_factor),
-					roundi(bitmap->height*resize_factor));
-
-	int x0 = 0;
-	int x1 = resized_bitmap.width;
-	int y0 = 0;
-	int y1 = resized_bitmap.height;
-
-	u8 *row = (u8 *)resized_bitmap.memory;
-	for (int y = y0; y < y1; y++) {
-		u32 *texel = (u32 *)row;
-		for (int x = x0; x < x1; x++) {
-			float u = (float)x / ((float)resized_bitmap.width - 1.0f);
-			float v = (float)y / ((float)resized_bitmap.height - 1.0f);
-			assert(0.0f <= u && u <= 1.0f);
-			assert(0.0f <= v && v <= 1.0f);
-
-			int sample_x = roundi(u*((float)bitmap->width - 1.0f));
-			int sample_y = roundi(v*((float)bitmap->height - 1.0f));
-			assert(0 <= sample_x && sample_x < bitmap->width);
-			assert(0 <= sample_y && sample_y < bitmap->height);
-
-			u32 sample = *(u32 *)((u8 *)bitmap->memory + sample_x*sizeof(u32) + sample_y*bitmap->pitch);
-
-			*texel++ = sample;
-		}
-
-		row += resized_bitmap.pitch;
-	}
-
-	free_bitmap(bitmap);
-	*bitmap = resized_bitmap;
-}
-
-static u32 assign_observation_to_cluster(KMeans_Cluster *clusters, int cluster_count,
-										 Vector3 observation) {
-	float closest_dist_squared = FLOAT_MAX;
-	u32 closest_cluster_index = 0;
-
-	for (int i = 0; i < cluster_count; i++) {
-		KMeans_Cluster *cluster = &clusters[i];
-
-		float d = length_squared(observation - cluster->centroid);
-		if (d < closest_dist_squared) {
-			closest_dist_squared = d;
-			closest_cluster_index = (u32)i;
-		}
-	}
-	assert(0 <= closest_cluster_index && closest_cluster_index < (u32)cluster_count);
-
-	KMeans_Cluster *closest_cluster = &clusters[closest_cluster_index];
-	if (closest_cluster->observation_count == closest_cluster->observation_capacity) {
-		closest_cluster->observation_capacity *= 2;
-		closest_cluster->observations = (Vector3 *)realloc(closest_cluster->observations, sizeof(Vector3)*closest_cluster->observation_capacity);
-	}
-	closest_cluster->observations[closest_cluster->observation_count++] = observation;
-
-	return closest_cluster_index;
-}
-
-static void recalculate_cluster_centroids(KMeans_Cluster *clusters, int cluster_count) {
-	for (int i = 0; i < cluster_count; i++) {
-		KMeans_Cluster *cluster = &clusters[i];
-
-		Vector3 sum = V3i(0, 0, 0);
-		for (int j = 0; j < cluster->observation_count; j++) {
-			sum += cluster->observations[j];
-		}
-
-		// It's erroneous to assert that cluster->observation_count is nonzero,
-		// see: https://stackoverflow.com/a/54821667. Replace the zero case below
-		// with a reseed?
-
-		if (cluster->observation_count) {
-			cluster->centroid = sum*(1.0f / cluster->observation_count);
-		} else {
-			cluster->centroid = sum;
-		}
-
-		cluster->observation_count = 0;
-	}
-}
-
-static void sort_clusters_by_centroid(KMeans_Cluster *clusters, int cluster_count,
-									  Sort_Type sort_type) {
-	Vector3 focal_color = V3i(0, 0, 0);
-	switch (sort_type) {
-		case SORT_TYPE_RED:
-			focal_color = {
-				53.23288178584245f,
-				80.10930952982204f,
-				67.22006831026425f
-			};
-			break;
-
-		case SORT_TYPE_GREEN:
-			focal_color = {
-				 87.73703347354422f,
-				-86.18463649762525f,
-				 83.18116474777854f
-			};
-			break;
-
-		case SORT_TYPE_BLUE:
-			focal_color = {
-				 32.302586667249486f,
-				 79.19666178930935f,
-				-107.86368104495168f
-			};
-			break;
-	}
-
-	for (int i = 0; i < cluster_count; i++) {
-		bool swapped = false;
-
-		for (int j = 0; j < (cluster_count - 1); j++) {
-			KMeans_Cluster *cluster_a = clusters + j;
-			KMeans_Cluster *cluster_b = clusters + j + 1;
-
-			if (sort_type == SORT_TYPE_WEIGHT) {
-				if (cluster_b->observation_count > cluster_a->observation_count) {
-					KMeans_Cluster swap = *cluster_a;
-					*cluster_a = *cluster_b;
-					*cluster_b = swap;
-
-					swapped = true;
-				}
-			} else if (sort_type == SORT_TYPE_RED || sort_type == SORT_TYPE_GREEN || sort_type == SORT_TYPE_BLUE) {
-				float dist_squared_to_color_a = length_squared(cluster_a->centroid - focal_color);
-				float dist_squared_to_color_b = length_squared(cluster_b->centroid - focal_color);
-				if (dist_squared_to_color_b < dist_squared_to_color_a) {
-					KMeans_Cluster swap = *cluster_a;
-					*cluster_a = *cluster_b;
-					*cluster_b = swap;
-
-					swapped = true;
-				}
-			}
-		}
-
-		if (!swapped) break;
-	}
-}
-
-static void export_bmp(Bitmap *bitmap, char *path) {
+static void export_bmp(Bitmap *bitmap, const char *path) {
 	FILE *file = fopen(path, "wb");
 	if (!file) {
 		fprintf(stderr, "fopen failed on %s\n", path);
@@ -291,94 +332,187 @@ static void export_bmp(Bitmap *bitmap, char *path) {
 
 int main(int argc, char **argv) {
 	if (argc <= 1) {
-		fprintf(stderr, "Usage: %s <source path> [cluster count] [seed] [sort type] [dest path]\n", argv[0]);
+		fprintf(stderr, "Usage: %s <source path> [cluster count or auto] [seed] [sort type] [dest path] [options]\n"
+						"Options:\n"
+						"  --method=lloyd|hamerly|elkan|yinyang|minibatch|kdtree|wu|octree|bisecting\n"
+						"  --init=random|kmeans++|greedy-kmeans++|wu|median-cut|<comma-separated hex colors>\n"
+						"  --init-lab=<comma-separated L, a and b of every initial cluster>\n"
+						"  --alpha-threshold=<least alpha of a pixel that counts, 0-255; 1 skips only fully transparent ones>\n"
+						"  --weight-by-alpha[=true|false]\n"
+						"  --init-candidates=<candidates per greedy k-means++ step, 0 for 2 + ln(k)>\n"
+						"  --n-init=<restarts, keeping the one with the lowest inertia>\n"
+						"  --batch-size=<observations per mini-batch>\n"
+						"  --max-dim=<largest sampled extent, 0 for full resolution>\n"
+						"  --sample-size=<most pixels read, overriding --max-dim, 0 for none>\n"
+						"  --sampling=grid|stratified|halton\n"
+						"  --pyramid[=true|false] (warm-start from coarser samplings first)\n"
+						"  --threads=<count, 0 for every hardware thread>\n"
+						"  --max-iter=<most assignment passes>\n"
+						"  --tol=<total centroid movement in CIELAB units to stop at>\n"
+						"  --change-tol=<fraction of relabelled pixels to stop at>\n"
+						"  --precision=float|fixed (fixed labels with 16-bit CIELAB, lloyd only)\n"
+						"  --coreset-size=<weighted colors sampled to cluster instead of every color, 0 for none>\n"
+						"  --k-max=<largest cluster count tried by auto>\n"
+						"  --k-criterion=elbow|silhouette|bic\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	Palettize_Config config = parse_config_from_command_line(argc, argv);
-
-	// To improve performance, source images with extents greater than
-	// MAX_BITMAP_DIM pixels are resized with nearest neighbor sampling
-	Bitmap source_bitmap;
-	load_bitmap(&source_bitmap, config.source_path);
-	if (source_bitmap.width > MAX_BITMAP_DIM || source_bitmap.height > MAX_BITMAP_DIM) {
-		resize_bitmap(&source_bitmap, MAX_BITMAP_DIM);
+	if (config.auto_cluster_count && config.method == CLUSTER_METHOD_OCTREE) {
+		fprintf(stderr, "The octree method can't pick the cluster count\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config.seed_method == SEED_METHOD_PALETTE && !config.auto_cluster_count &&
+		config.initial_centroid_count != config.cluster_count) {
+		fprintf(stderr, "%d initial clusters given for a cluster count of %d\n", config.initial_centroid_count,
+				config.cluster_count);
+		exit(EXIT_FAILURE);
 	}
 
-	Bitmap prev_cluster_index_buffer;
-	allocate_bitmap(&prev_cluster_index_buffer, source_bitmap.width, source_bitmap.height);
+	// The octree only needs one row at a time, so when it reads every pixel of
+	// a file laid out in rows it never decodes the whole image
+	Row_Reader row_reader = {};
+	bool stream_rows = false;
+	if (config.method == CLUSTER_METHOD_OCTREE && open_row_reader(&row_reader, config.source_path)) {
+		stream_rows = reads_every_texel(row_reader.width, row_reader.height, &config);
+		if (!stream_rows) close_row_reader(&row_reader);
+	}
 
-	Random_Series entropy = seed_series(config.seed);
+	// To improve performance, source images with more than config.sample_size
+	// pixels or extents greater than config.max_dim pixels are sampled rather
+	// than read in full
+	Bitmap source_bitmap = {};
+	Bitmap_Sampler sampler = {};
+	if (!stream_rows) {
+		load_bitmap(&source_bitmap, config.source_path);
+		sampler = create_bitmap_sampler(source_bitmap, &config);
+	}
 
 	int cluster_count = config.cluster_count;
 	KMeans_Cluster *clusters = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count);
-	for (int i = 0; i < cluster_count; i++) {
-		KMeans_Cluster *cluster = &clusters[i];
-
-		cluster->observation_capacity = 512;
-		cluster->observation_count = 0;
-		cluster->observations = (Vector3 *)malloc(sizeof(Vector3)*cluster->observation_capacity);
 
-		// Naive cluster seeding
-		u32 sample_x = random_u32_between(&entropy, 0, (u32)(source_bitmap.width - 1));
-		u32 sample_y = random_u32_between(&entropy, 0, (u32)(source_bitmap.height - 1));
-		u32 sample = *(u32 *)get_bitmap_ptr(source_bitmap, sample_x, sample_y);
-
-		cluster->centroid = unpack_rgba_to_cielab(sample);
-	}
-
-	int x0 = 0;
-	int x1 = source_bitmap.width;
-	int y0 = 0;
-	int y1 = source_bitmap.height;
-
-	for (int iteration = 0;; iteration++) {
-		bool assignments_changed = false;
-
-		u8 *row = (u8 *)get_bitmap_ptr(source_bitmap, x0, y0);
-		u8 *prev_cluster_index_row = (u8 *)get_bitmap_ptr(prev_cluster_index_buffer, x0, y0);
-		for (int y = y0; y < y1; y++) {
-			u32 *texel = (u32 *)row;
-			u32 *prev_cluster_index_ptr = (u32 *)prev_cluster_index_row;
-			for (int x = x0; x < x1; x++) {
-				Vector3 texel_v3 = unpack_rgba_to_cielab(*texel);
-
-				u32 closest_cluster_index = assign_observation_to_cluster(clusters, cluster_count, texel_v3);
-				if (iteration > 0) {
-					u32 prev_cluster_index = *prev_cluster_index_ptr;
-					if (closest_cluster_index != prev_cluster_index) {
-						assignments_changed = true;
-					}
-				}
+	double *restart_inertias = (double *)malloc(sizeof(double)*config.restart_count);
+	KMeans_Result kmeans_result;
+	if (config.method == CLUSTER_METHOD_OCTREE) {
+		// The octree reads the image a row at a time and never builds the
+		// observation buffer, so it has nothing to restart
+		if (stream_rows) {
+			kmeans_result = quantize_file_octree(clusters, cluster_count, &row_reader, config.alpha_threshold,
+												 config.weight_by_alpha);
+			close_row_reader(&row_reader);
+		} else {
+			kmeans_result = quantize_bitmap_octree(clusters, cluster_count, sampler, config.alpha_threshold,
+												   config.weight_by_alpha);
+		}
+		config.restart_count = 1;
+		restart_inertias[0] = kmeans_result.inertia;
+	} else {
+		Observation_Buffer observations = convert_bitmap_to_cielab(sampler, config.alpha_threshold, config.weight_by_alpha);
+
+		Thread_Pool pool;
+		create_thread_pool(&pool, config.thread_count);
+
+		// The coarser levels of a pyramid leave the sampled bitmap with only
+		// polishing to do
+		Vector3 *pyramid_centroids = (Vector3 *)malloc(sizeof(Vector3)*cluster_count);
+		int level_iterations[PYRAMID_MAX_LEVELS];
+		int level_count = cluster_bitmap_pyramid(pyramid_centroids, cluster_count, source_bitmap, &config, &pool,
+												 level_iterations);
+		if (level_count > 0) {
+			for (int level = 0; level < level_count; level++) {
+				fprintf(stderr, "Pyramid level %d took %d iterations\n", level + 1, level_iterations[level]);
+			}
+			config.seed_method = SEED_METHOD_PALETTE;
+			config.initial_centroids = pyramid_centroids;
+			config.initial_centroid_count = cluster_count;
+			config.restart_count = 1;
+		}
 
-				texel++;
-				*prev_cluster_index_ptr++ = closest_cluster_index;
+		// A coreset stands in for the observations while clustering, and the
+		// clusters are reweighed against every observation afterwards
+		Observation_Buffer coreset = {};
+		if (config.coreset_size > 0 && observations.count > config.coreset_size) {
+			coreset = build_coreset(observations, config.coreset_size, cluster_count, config.seed, &pool);
+		}
+		Observation_Buffer clustered = coreset.l ? coreset : observations;
+
+		u8 *prev_cluster_indices = (u8 *)malloc(sizeof(u8)*clustered.count);
+
+		if (config.auto_cluster_count) {
+			double *scores = (double *)malloc(sizeof(double)*config.cluster_count);
+			double *inertias = (double *)malloc(sizeof(double)*config.cluster_count);
+			kmeans_result = cluster_observations_sweep(clusters, config.cluster_count, &cluster_count, scores, inertias,
+													   sampler, clustered, prev_cluster_indices, &config, &pool);
+			for (int k = 1; k <= config.cluster_count; k++) {
+				fprintf(stderr, "%d clusters inertia %.1f score %g%s\n", k, inertias[k - 1], scores[k - 1],
+						(k == cluster_count) ? " (kept)" : "");
 			}
+			free(inertias);
+			free(scores);
+
+			config.restart_count = 1;
+			restart_inertias[0] = kmeans_result.inertia;
+		} else if (config.method == CLUSTER_METHOD_BISECTING) {
+			// Bisecting spends its restarts as 2-means trials on every split
+			kmeans_result = cluster_observations_bisecting(clusters, 0, cluster_count, clustered,
+														   prev_cluster_indices, &config, &pool);
+			config.restart_count = 1;
+			restart_inertias[0] = kmeans_result.inertia;
+		} else {
+			kmeans_result = cluster_observations_with_restarts(clusters, cluster_count, sampler, clustered,
+															   prev_cluster_indices, &config, &pool, restart_inertias);
+		}
 
-			row += source_bitmap.pitch;
-			prev_cluster_index_row += prev_cluster_index_buffer.pitch;
+		if (coreset.l) {
+			kmeans_result.inertia = measure_inertia(clusters, cluster_count, observations, &pool, true);
+			free_observation_buffer(&coreset);
 		}
 
-		if (iteration == 0 || assignments_changed) recalculate_cluster_centroids(clusters, cluster_count); else break;
+		destroy_thread_pool(&pool);
+
+		free(prev_cluster_indices);
+		free(pyramid_centroids);
+		free_observation_buffer(&observations);
 	}
+	fprintf(stderr, "%s after %d iterations\n", kmeans_result.converged ? "Converged" : "Stopped",
+			kmeans_result.iteration_count);
+	if (config.restart_count > 1) {
+		for (int i = 0; i < config.restart_count; i++) {
+			fprintf(stderr, "Restart %d inertia %.1f%s\n", i + 1, restart_inertias[i],
+					(i == kmeans_result.restart_index) ? " (kept)" : "");
+		}
+	}
+	free(restart_inertias);
 
 	sort_clusters_by_centroid(clusters, cluster_count, config.sort_type);
 
 	u8 *scanline = (u8 *)malloc(sizeof(u32)*PALETTE_BITMAP_WIDTH);
 
+	float total_weight = 0.0f;
+	for (int i = 0; i < cluster_count; i++) {
+		total_weight += clusters[i].observation_weight;
+	}
+
 	u32 *row = (u32 *)scanline;
+	u32 *row_end = row + PALETTE_BITMAP_WIDTH;
 	for (int i = 0; i < cluster_count; i++) {
 		KMeans_Cluster *cluster = &clusters[i];
 
-		float weight = (float)cluster->observation_count / (float)(source_bitmap.width*source_bitmap.height);
+		float weight = cluster->observation_weight / total_weight;
 		int cluster_width = roundi(weight*PALETTE_BITMAP_WIDTH);
 
 		u32 color = pack_cielab_to_rgba(cluster->centroid);
-		while (cluster_width--) {
+		while (cluster_width-- && row < row_end) {
 			*row++ = color;
 		}
 	}
 
+	// Rounding can leave a few texels at the end, which take the last color
+	u32 last_color = pack_cielab_to_rgba(clusters[cluster_count - 1].centroid);
+	while (row < row_end) {
+		*row++ = last_color;
+	}
+
 	Bitmap palette_bitmap;
 	allocate_bitmap(&palette_bitmap, PALETTE_BITMAP_WIDTH, PALETTE_BITMAP_HEIGHT);
 	u8 *dest_row = (u8 *)palette_bitmap.memory;
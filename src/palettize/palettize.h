@@ -28,6 +28,9 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define Invalid_Code_Path assert(!"Invalid code path")
 #define Invalid_Default_Case default: {Invalid_Code_Path;} break
@@ -37,11 +40,17 @@
 #define maximum(a, b) ((a) > (b) ? (a) : (b))
 #define minimum(a, b) ((a) < (b) ? (a) : (b))
 
+// Palettes for indexed formats like GIF and PNG-8 need up to 256 colors, and
+// with no more than that a cluster index fits in a u8
+#define MAX_CLUSTER_COUNT 256
+
+typedef int16_t s16;
 typedef int32_t s32;
 
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 #include "palettize_math.h"
 #include "palettize_random.h"
@@ -54,12 +63,73 @@ enum Sort_Type {
     SORT_TYPE_BLUE,
 };
 
+enum Cluster_Method {
+    CLUSTER_METHOD_LLOYD,
+    CLUSTER_METHOD_HAMERLY,
+    CLUSTER_METHOD_ELKAN,
+    CLUSTER_METHOD_YINYANG,
+    CLUSTER_METHOD_MINIBATCH,
+    CLUSTER_METHOD_KDTREE,
+    CLUSTER_METHOD_WU,
+    CLUSTER_METHOD_OCTREE,
+    CLUSTER_METHOD_BISECTING,
+};
+
+enum Seed_Method {
+    SEED_METHOD_RANDOM,
+    SEED_METHOD_KMEANS_PLUS_PLUS,
+    SEED_METHOD_GREEDY_KMEANS_PLUS_PLUS,
+    SEED_METHOD_WU,
+    SEED_METHOD_MEDIAN_CUT,
+    SEED_METHOD_PALETTE,
+};
+
+enum Sample_Pattern {
+    SAMPLE_PATTERN_GRID,
+    SAMPLE_PATTERN_STRATIFIED,
+    SAMPLE_PATTERN_HALTON,
+};
+
+enum Count_Criterion {
+    COUNT_CRITERION_ELBOW,
+    COUNT_CRITERION_SILHOUETTE,
+    COUNT_CRITERION_BIC,
+};
+
 struct Palettize_Config {
-    char *source_path;
+    const char *source_path;
     int cluster_count;
     u32 seed;
     Sort_Type sort_type;
-    char *dest_path;
+    Cluster_Method method;
+    Seed_Method seed_method;
+    int seed_candidates;
+    // Pixels less opaque than alpha_threshold are left out, and with
+    // weight_by_alpha the rest count in proportion to their alpha
+    int alpha_threshold;
+    bool weight_by_alpha;
+    // With SEED_METHOD_PALETTE, the first cluster_count of these are the seeds
+    Vector3 *initial_centroids;
+    int initial_centroid_count;
+    int restart_count;
+    int batch_size;
+    // Bitmaps over sample_size pixels, or failing that wider or taller than
+    // max_dim, are sampled with sample_pattern instead of read in full
+    int max_dim;
+    int sample_size;
+    Sample_Pattern sample_pattern;
+    // Cluster a pyramid of coarser samplings first (see palettize_pyramid.h)
+    bool pyramid;
+    int thread_count;
+    int max_iterations;
+    float tolerance;
+    float min_change_fraction;
+    bool fixed_point;
+    int coreset_size;
+    // With auto_cluster_count, cluster_count is the largest count tried
+    bool auto_cluster_count;
+    Count_Criterion count_criterion;
+    const char *dest_path;
 };
 
 #define get_bitmap_ptr(b, x, y) ((u8 *)(b).memory + (sizeof(u32)*(x)) + ((y)*(b).pitch))
@@ -73,9 +143,55 @@ struct Bitmap {
 struct KMeans_Cluster {
     Vector3 centroid;
 
-    int observation_count;
-    int observation_capacity;
-    Vector3 *observations;
+    Vector3 observation_sum;
+    float observation_weight;
+};
+
+struct KMeans_Result {
+    int iteration_count;
+    bool converged;
+    double inertia;
+    bool has_inertia;
+    int restart_index;
+};
+
+// Observations and centroids are stored as separate L, a and b planes so the
+// assignment kernels can load one channel for several points at once. Planes
+// are padded out to a multiple of SIMD_MAX_LANES.
+//
+// Each observation is a unique color weighted by the number of texels that
+// share it. The fixed-point planes are an optional 16-bit copy of L, a and b
+// (see quantize_observations()) and are null unless they've been built.
+#define SIMD_MAX_LANES 16
+struct Observation_Buffer {
+    int count;
+    int capacity;
+    float *l;
+    float *a;
+    float *b;
+
+    float *weights;
+    float total_weight;
+
+    s16 *fixed_l;
+    s16 *fixed_a;
+    s16 *fixed_b;
+};
+
+struct Centroid_Block {
+    int count;
+    int capacity;
+    float *l;
+    float *a;
+    float *b;
+};
+
+struct Fixed_Centroid_Block {
+    int count;
+    int capacity;
+    s16 *l;
+    s16 *a;
+    s16 *b;
 };
 
 #pragma pack(push, 1)
@@ -101,4 +217,17 @@ struct Bitmap_Header {
 };
 #pragma pack(pop)
 
+#include "palettize_simd.h"
+#include "palettize_thread.h"
+#include "palettize_wu.h"
+#include "palettize_median_cut.h"
+#include "palettize_sample.h"
+#include "palettize_stream.h"
+#include "palettize_octree.h"
+#include "palettize_kmeans.h"
+#include "palettize_coreset.h"
+#include "palettize_bisect.h"
+#include "palettize_sweep.h"
+#include "palettize_pyramid.h"
+
 #endif
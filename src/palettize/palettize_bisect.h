@@ -0,0 +1,404 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_BISECT_H
+#define PALETTIZE_BISECT_H
+
+// Bisecting k-means (Steinbach, Karypis and Kumar, "A Comparison of Document
+// Clustering Techniques"). Starting from one cluster holding every
+// observation, the cluster with the largest sum of squared distances to its
+// mean is split in two with 2-means until there are cluster_count clusters.
+// Every split only touches the observations of the cluster being split, and
+// the clusters after each split form the palette for that many colors, so
+// one run yields nested palettes for every count up to cluster_count.
+//
+// Each cluster owns a contiguous range of a copy of the observation buffer,
+// and splitting it partitions the range in place, so every pass streams
+// through memory rather than gathering from the original buffer.
+struct Bisect_Node {
+    int first;
+    int count;
+
+    // Weight, L, a, b and squared norm summed over the node's observations
+    double moments[5];
+    double sse;
+};
+
+// 2-means sums for one chunk of the range being split. Only side 1 is summed;
+// side 0 is whatever's left of the node.
+struct Bisect_Partial {
+    double moments[5];
+    double changed_weight;
+};
+
+struct Bisect_Run {
+    // The copy, and the index each of its observations has in the original
+    Observation_Buffer observations;
+    int *order;
+    u8 *sides;
+
+    int first;
+    int count;
+    Vector3 centroids[2];
+    bool first_pass;
+
+    Bisect_Partial *partials;
+};
+
+inline double get_bisect_sse(double *moments) {
+    if (moments[0] <= 0.0) return 0.0;
+
+    double result = moments[4] - (moments[1]*moments[1] + moments[2]*moments[2] + moments[3]*moments[3]) / moments[0];
+    result = maximum(0.0, result);
+
+    return result;
+}
+
+inline void bisect_assignment_task(void *data, int chunk_index) {
+    Bisect_Run *run = (Bisect_Run *)data;
+    Observation_Buffer observations = run->observations;
+
+    int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+    int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, run->count);
+
+    // Everything the loop touches is in locals, since the u8 label stores
+    // could alias any of it
+    u8 *sides = run->sides;
+    int first = run->first;
+    double moments[5] = {};
+    double changed_weight = 0.0;
+    Vector3 c0 = run->centroids[0];
+    Vector3 c1 = run->centroids[1];
+    for (int i = chunk_first; i < chunk_end; i++) {
+        int j = first + i;
+        float l = observations.l[j];
+        float a = observations.a[j];
+        float b = observations.b[j];
+        float w = observations.weights[j];
+
+        float d0 = cielab_distance_squared(l, a, b, c0.x, c0.y, c0.z);
+        float d1 = cielab_distance_squared(l, a, b, c1.x, c1.y, c1.z);
+        u8 side = (d1 < d0) ? 1 : 0;
+        changed_weight += (side != sides[i]) ? w : 0.0f;
+        sides[i] = side;
+
+        // Without a branch on the side, which would mispredict half the time
+        double side_w = side ? w : 0.0f;
+        moments[0] += side_w;
+        moments[1] += side_w*l;
+        moments[2] += side_w*a;
+        moments[3] += side_w*b;
+        moments[4] += side_w*((double)l*l + (double)a*a + (double)b*b);
+    }
+
+    Bisect_Partial *partial = &run->partials[chunk_index];
+    memcpy(partial->moments, moments, sizeof(moments));
+    partial->changed_weight = changed_weight;
+}
+
+// Draws an observation of the range with probability proportional to its
+// weight times dists[i], or to its weight alone if dists is null
+inline int sample_bisect_observation(Bisect_Run *run, float *dists, double *cumulative, Random_Series *entropy) {
+    double total = 0.0;
+    for (int i = 0; i < run->count; i++) {
+        total += (double)run->observations.weights[run->first + i]*(dists ? dists[i] : 1.0f);
+        cumulative[i] = total;
+    }
+
+    double target = random_unilateral(entropy)*total;
+
+    int lo = 0;
+    int hi = run->count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (cumulative[mid] <= target) lo = mid + 1; else hi = mid;
+    }
+
+    return run->first + lo;
+}
+
+inline void partition_bisect_plane(float *plane, u8 *sides, int count, float *scratch) {
+    int left_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (sides[i] == 0) plane[left_count++] = plane[i];
+        else scratch[i - left_count] = plane[i];
+    }
+    memcpy(plane + left_count, scratch, sizeof(float)*(count - left_count));
+}
+
+inline int partition_bisect_range(Bisect_Run *run, u8 *sides) {
+    int first = run->first;
+    int count = run->count;
+
+    float *scratch = (float *)malloc(sizeof(float)*count);
+    partition_bisect_plane(run->observations.l + first, sides, count, scratch);
+    partition_bisect_plane(run->observations.a + first, sides, count, scratch);
+    partition_bisect_plane(run->observations.b + first, sides, count, scratch);
+    partition_bisect_plane(run->observations.weights + first, sides, count, scratch);
+    free(scratch);
+
+    int *order_scratch = (int *)malloc(sizeof(int)*count);
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (sides[i] == 0) run->order[first + result++] = run->order[first + i];
+        else order_scratch[i - result] = run->order[first + i];
+    }
+    memcpy(run->order + first + result, order_scratch, sizeof(int)*(count - result));
+    free(order_scratch);
+
+    return result;
+}
+
+// Splits the node with the best of config->restart_count 2-means trials, each
+// seeded k-means++ style. Returns false, leaving the order untouched, if no
+// trial separated the observations.
+inline bool split_bisect_node(Bisect_Node *node, Bisect_Node *left, Bisect_Node *right, Bisect_Run *run,
+                              u8 *best_sides, float *dists, double *cumulative, int *iteration_count,
+                              bool *converged, Palettize_Config *config, Random_Series *entropy,
+                              Thread_Pool *pool) {
+    run->first = node->first;
+    run->count = node->count;
+    int chunk_count = (run->count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+
+    int trial_count = maximum(1, config->restart_count);
+    double best_sse = node->sse;
+    double best_moments[2][5] = {};
+    bool best_converged = true;
+    bool split = false;
+    for (int trial = 0; trial < trial_count; trial++) {
+        int seed = sample_bisect_observation(run, 0, cumulative, entropy);
+        run->centroids[0] = get_observation(run->observations, seed);
+        for (int i = 0; i < run->count; i++) {
+            int j = run->first + i;
+            dists[i] = cielab_distance_squared(run->observations.l[j], run->observations.a[j],
+                                               run->observations.b[j], run->centroids[0].x,
+                                               run->centroids[0].y, run->centroids[0].z);
+        }
+        seed = sample_bisect_observation(run, dists, cumulative, entropy);
+        run->centroids[1] = get_observation(run->observations, seed);
+
+        double moments[2][5] = {};
+        bool trial_converged = false;
+        memset(run->sides, 0, sizeof(u8)*run->count);
+        run->first_pass = true;
+        for (int iteration = 0; iteration < config->max_iterations; iteration++) {
+            run_parallel(pool, chunk_count, bisect_assignment_task, run);
+            (*iteration_count)++;
+
+            double changed_weight = 0.0;
+            memset(moments, 0, sizeof(moments));
+            for (int chunk_index = 0; chunk_index < chunk_count; chunk_index++) {
+                Bisect_Partial *partial = &run->partials[chunk_index];
+                for (int m = 0; m < 5; m++) {
+                    moments[1][m] += partial->moments[m];
+                }
+                changed_weight += partial->changed_weight;
+            }
+            for (int m = 0; m < 5; m++) {
+                moments[0][m] = node->moments[m] - moments[1][m];
+            }
+
+            // A side only empties out on ties, and then the trial is given up
+            if (moments[0][0] <= 0.0 || moments[1][0] <= 0.0) break;
+
+            float shift = 0.0f;
+            for (int side = 0; side < 2; side++) {
+                Vector3 centroid = V3((float)(moments[side][1] / moments[side][0]),
+                                      (float)(moments[side][2] / moments[side][0]),
+                                      (float)(moments[side][3] / moments[side][0]));
+                shift += sqrt(length_squared(centroid - run->centroids[side]));
+                run->centroids[side] = centroid;
+            }
+
+            if (!run->first_pass &&
+                (changed_weight <= (double)config->min_change_fraction*node->moments[0] ||
+                 shift <= config->tolerance)) {
+                trial_converged = true;
+                break;
+            }
+            run->first_pass = false;
+        }
+        if (moments[0][0] <= 0.0 || moments[1][0] <= 0.0) continue;
+
+        double sse = get_bisect_sse(moments[0]) + get_bisect_sse(moments[1]);
+        if (!split || sse < best_sse) {
+            best_sse = sse;
+            memcpy(best_moments, moments, sizeof(moments));
+            memcpy(best_sides, run->sides, sizeof(u8)*run->count);
+            best_converged = trial_converged;
+            split = true;
+        }
+    }
+
+    if (split) {
+        // Stable partition of the range, side 0 first, so the palette doesn't
+        // depend on anything but the labels
+        int left_count = partition_bisect_range(run, best_sides);
+
+        left->first = node->first;
+        left->count = left_count;
+        memcpy(left->moments, best_moments[0], sizeof(left->moments));
+        left->sse = get_bisect_sse(left->moments);
+
+        right->first = node->first + left_count;
+        right->count = node->count - left_count;
+        memcpy(right->moments, best_moments[1], sizeof(right->moments));
+        right->sse = get_bisect_sse(right->moments);
+
+        if (!best_converged) *converged = false;
+    }
+
+    return split;
+}
+
+inline void store_bisect_palette(KMeans_Cluster *clusters, Bisect_Node *nodes, int node_count, int cluster_count) {
+    int heaviest = 0;
+    for (int i = 0; i < node_count; i++) {
+        Bisect_Node *node = &nodes[i];
+        KMeans_Cluster *cluster = &clusters[i];
+        double weight = node->moments[0];
+
+        cluster->observation_sum = V3((float)node->moments[1], (float)node->moments[2], (float)node->moments[3]);
+        cluster->observation_weight = (float)weight;
+        cluster->centroid = V3((float)(node->moments[1] / weight), (float)(node->moments[2] / weight),
+                               (float)(node->moments[3] / weight));
+
+        if (weight > nodes[heaviest].moments[0]) heaviest = i;
+    }
+
+    // With fewer distinct colors than clusters the rest repeat the heaviest
+    // cluster without any weight, as Wu's quantizer does
+    for (int i = node_count; i < cluster_count; i++) {
+        clusters[i].centroid = clusters[heaviest].centroid;
+        clusters[i].observation_sum = V3i(0, 0, 0);
+        clusters[i].observation_weight = 0.0f;
+    }
+}
+
+// The palette for k colors starts at nested_palettes[k*(k - 1)/2], so the
+// array needs room for cluster_count*(cluster_count + 1)/2 clusters. Either
+// the nested palettes or the labels can be null.
+inline KMeans_Result cluster_observations_bisecting(KMeans_Cluster *clusters, KMeans_Cluster *nested_palettes,
+                                                    int cluster_count, Observation_Buffer observations,
+                                                    u8 *prev_cluster_indices, Palettize_Config *config,
+                                                    Thread_Pool *pool) {
+    KMeans_Result result = {};
+    result.converged = true;
+
+    Random_Series entropy = seed_series(config->seed);
+
+    int chunk_count = (observations.count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+
+    Bisect_Run run = {};
+    run.observations = allocate_observation_buffer(observations.count);
+    run.observations.total_weight = observations.total_weight;
+    memcpy(run.observations.l, observations.l, sizeof(float)*observations.capacity);
+    memcpy(run.observations.a, observations.a, sizeof(float)*observations.capacity);
+    memcpy(run.observations.b, observations.b, sizeof(float)*observations.capacity);
+    memcpy(run.observations.weights, observations.weights, sizeof(float)*observations.capacity);
+    run.order = (int *)malloc(sizeof(int)*observations.count);
+    run.sides = (u8 *)malloc(sizeof(u8)*observations.count);
+    run.partials = (Bisect_Partial *)malloc(sizeof(Bisect_Partial)*chunk_count);
+
+    u8 *best_sides = (u8 *)malloc(sizeof(u8)*observations.count);
+    float *dists = (float *)malloc(sizeof(float)*observations.count);
+    double *cumulative = (double *)malloc(sizeof(double)*observations.count);
+
+    Bisect_Node *nodes = (Bisect_Node *)malloc(sizeof(Bisect_Node)*cluster_count);
+    Bisect_Node *root = &nodes[0];
+    *root = {};
+    root->count = observations.count;
+    for (int i = 0; i < observations.count; i++) {
+        run.order[i] = i;
+
+        double w = observations.weights[i];
+        double l = observations.l[i];
+        double a = observations.a[i];
+        double b = observations.b[i];
+        root->moments[0] += w;
+        root->moments[1] += w*l;
+        root->moments[2] += w*a;
+        root->moments[3] += w*b;
+        root->moments[4] += w*(l*l + a*a + b*b);
+    }
+    root->sse = get_bisect_sse(root->moments);
+    int node_count = 1;
+
+    // Nodes that failed to split are parked with a negative SSE so they're
+    // never picked again
+    for (int k = 1; k <= cluster_count; k++) {
+        if (nested_palettes) store_bisect_palette(nested_palettes + k*(k - 1)/2, nodes, node_count, k);
+        if (k == cluster_count) break;
+
+        for (;;) {
+            int target = -1;
+            for (int i = 0; i < node_count; i++) {
+                if (nodes[i].count > 1 && nodes[i].sse > 0.0 &&
+                    (target < 0 || nodes[i].sse > nodes[target].sse)) {
+                    target = i;
+                }
+            }
+            if (target < 0) break;
+
+            Bisect_Node left;
+            Bisect_Node right;
+            if (split_bisect_node(&nodes[target], &left, &right, &run, best_sides, dists, cumulative,
+                                  &result.iteration_count, &result.converged, config, &entropy, pool)) {
+                nodes[target] = left;
+                nodes[node_count++] = right;
+                break;
+            }
+            nodes[target].sse = -1.0;
+        }
+    }
+
+    store_bisect_palette(clusters, nodes, node_count, cluster_count);
+    if (prev_cluster_indices) {
+        for (int i = 0; i < node_count; i++) {
+            for (int j = 0; j < nodes[i].count; j++) {
+                prev_cluster_indices[run.order[nodes[i].first + j]] = (u8)i;
+            }
+        }
+    }
+
+    // The clusters are the nodes' means rather than a Voronoi partition, so
+    // the inertia is measured against the nearest palette color like every
+    // other method's
+    result.inertia = measure_inertia(clusters, cluster_count, observations, pool);
+    result.has_inertia = true;
+
+    free(nodes);
+    free(cumulative);
+    free(dists);
+    free(best_sides);
+    free(run.partials);
+    free(run.sides);
+    free(run.order);
+    free_observation_buffer(&run.observations);
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,174 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_CORESET_H
+#define PALETTIZE_CORESET_H
+
+// Coresets by sensitivity sampling (Bachem, Lucic and Krause, "Practical
+// Coreset Constructions for Machine Learning", algorithm 2). A k-means++ pass
+// gives a rough solution B, and every observation is drawn with probability
+// proportional to its weight times an upper bound on its sensitivity, the
+// largest share of the cost it could carry for any set of k centroids:
+//
+//   s(x) = a*d(x, B)^2/c + 2a*sum_Bx d(x', B)^2/(|Bx|*c) + 4|X|/|Bx|
+//
+// where Bx is the observations sharing x's nearest point of B, c is the mean
+// squared distance to B and a = 16(log k + 2). Each draw is weighted by the
+// inverse of its probability, so the weighted cost of any centroids on the
+// coreset is an unbiased estimate of their cost on every observation, and
+// with enough draws it's within a factor of 1 +- epsilon with high
+// probability. Unlike downsampling the bitmap, a small region of distant
+// colors keeps its share of draws.
+//
+// Draws of the same observation are merged, so the coreset can hold fewer
+// than size observations.
+struct Coreset_Run {
+    Observation_Buffer observations;
+    Label_Observations_Kernel *label_observations;
+    Centroid_Block centroids;
+
+    u32 *labels;
+    float *dists;
+};
+
+inline void coreset_labelling_task(void *data, int chunk_index) {
+    Coreset_Run *run = (Coreset_Run *)data;
+
+    int first = chunk_index*KMEANS_CHUNK_SIZE;
+    int count = minimum(KMEANS_CHUNK_SIZE, run->observations.count - first);
+    run->label_observations(run->observations, first, count, run->centroids, run->labels + first);
+
+    for (int i = first; i < first + count; i++) {
+        u32 j = run->labels[i];
+        run->dists[i] = cielab_distance_squared(run->observations.l[i], run->observations.a[i],
+                                                run->observations.b[i],
+                                                run->centroids.l[j], run->centroids.a[j], run->centroids.b[j]);
+    }
+}
+
+inline Observation_Buffer build_coreset(Observation_Buffer observations, int size, int cluster_count, u32 seed,
+                                        Thread_Pool *pool) {
+    Random_Series entropy = seed_series(seed);
+    int chunk_count = (observations.count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+
+    KMeans_Cluster *clusters = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count);
+    seed_clusters_kmeans_plus_plus(clusters, cluster_count, observations, 1, &entropy, pool);
+
+    Coreset_Run run;
+    run.observations = observations;
+    run.label_observations = get_label_observations_kernel(query_simd_level());
+    allocate_centroid_block(&run.centroids, cluster_count);
+    pack_centroid_block(&run.centroids, clusters, cluster_count);
+    run.labels = (u32 *)malloc(sizeof(u32)*observations.count);
+    run.dists = (float *)malloc(sizeof(float)*observations.count);
+
+    run_parallel(pool, chunk_count, coreset_labelling_task, &run);
+
+    // Summed in observation order so the coreset doesn't depend on the
+    // thread count
+    double *cluster_weights = (double *)calloc(cluster_count, sizeof(double));
+    double *cluster_costs = (double *)calloc(cluster_count, sizeof(double));
+    double total_weight = 0.0;
+    double total_cost = 0.0;
+    for (int i = 0; i < observations.count; i++) {
+        double weight = observations.weights[i];
+        double cost = weight*run.dists[i];
+        cluster_weights[run.labels[i]] += weight;
+        cluster_costs[run.labels[i]] += cost;
+        total_weight += weight;
+        total_cost += cost;
+    }
+
+    double alpha = 16.0*(log((double)cluster_count) + 2.0);
+    double mean_cost = total_cost / total_weight;
+
+    double *cumulative = (double *)malloc(sizeof(double)*observations.count);
+    double total_sensitivity = 0.0;
+    for (int i = 0; i < observations.count; i++) {
+        u32 j = run.labels[i];
+        double sensitivity = 4.0*total_weight / cluster_weights[j];
+        if (mean_cost > 0.0) {
+            sensitivity += alpha*run.dists[i] / mean_cost +
+                           2.0*alpha*cluster_costs[j] / (cluster_weights[j]*mean_cost);
+        }
+
+        total_sensitivity += observations.weights[i]*sensitivity;
+        cumulative[i] = total_sensitivity;
+    }
+
+    // Slots map observations to their place in the coreset, so repeated draws
+    // add up
+    int *slots = (int *)malloc(sizeof(int)*observations.count);
+    for (int i = 0; i < observations.count; i++) slots[i] = -1;
+
+    int *drawn = (int *)malloc(sizeof(int)*size);
+    double *drawn_weights = (double *)malloc(sizeof(double)*size);
+    int drawn_count = 0;
+    for (int s = 0; s < size; s++) {
+        double target = random_unilateral(&entropy)*total_sensitivity;
+
+        int lo = 0;
+        int hi = observations.count - 1;
+        while (lo < hi) {
+            int mid = lo + (hi - lo)/2;
+            if (cumulative[mid] <= target) lo = mid + 1; else hi = mid;
+        }
+
+        double probability = (cumulative[lo] - (lo > 0 ? cumulative[lo - 1] : 0.0)) / total_sensitivity;
+        double weight = observations.weights[lo] / (probability*(double)size);
+        if (slots[lo] < 0) {
+            slots[lo] = drawn_count;
+            drawn[drawn_count] = lo;
+            drawn_weights[drawn_count] = 0.0;
+            drawn_count++;
+        }
+        drawn_weights[slots[lo]] += weight;
+    }
+
+    Observation_Buffer result = allocate_observation_buffer(drawn_count);
+    for (int i = 0; i < drawn_count; i++) {
+        int index = drawn[i];
+        result.l[i] = observations.l[index];
+        result.a[i] = observations.a[index];
+        result.b[i] = observations.b[index];
+        result.weights[i] = (float)drawn_weights[i];
+        result.total_weight += result.weights[i];
+    }
+
+    free(drawn_weights);
+    free(drawn);
+    free(slots);
+    free(cumulative);
+    free(cluster_costs);
+    free(cluster_weights);
+    free(run.dists);
+    free(run.labels);
+    free_centroid_block(&run.centroids);
+    free(clusters);
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,2162 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_KMEANS_H
+#define PALETTIZE_KMEANS_H
+
+struct Color_Histogram {
+    int count;
+    u32 *colors;
+
+    // Pixels per color, or their summed alpha when weighting by alpha
+    u64 *counts;
+};
+
+// Collapses the sampled pixels into their unique colors, in order of first
+// appearance, using an open-addressing hash table keyed on the packed RGB
+// value. Pixels with an alpha below alpha_threshold never make it in, so
+// transparent regions don't cost anything downstream; otherwise alpha only
+// matters as a weight. If no pixel is opaque enough, every pixel is kept so
+// there's still something to cluster.
+inline Color_Histogram build_color_histogram(Bitmap_Sampler sampler, int alpha_threshold, bool weight_by_alpha) {
+    int texel_count = get_sample_count(&sampler);
+
+    u32 table_capacity = 64;
+    while (table_capacity < 2*(u32)texel_count) table_capacity *= 2;
+    u32 table_mask = table_capacity - 1;
+
+    const u32 empty_slot = 0xFFFFFFFF;
+    u32 *table = (u32 *)malloc(sizeof(u32)*table_capacity);
+    for (u32 i = 0; i < table_capacity; i++) table[i] = empty_slot;
+
+    Color_Histogram result;
+    result.count = 0;
+    result.colors = (u32 *)malloc(sizeof(u32)*texel_count);
+    result.counts = (u64 *)malloc(sizeof(u64)*texel_count);
+
+    u32 *scratch = (u32 *)malloc(sizeof(u32)*sampler.columns);
+    for (int y = 0; y < sampler.rows; y++) {
+        u32 *texel = read_bitmap_sample_row(&sampler, y, scratch);
+        for (int x = 0; x < sampler.columns; x++) {
+            u32 alpha = *texel >> 24;
+            u32 color = *texel++ & 0x00FFFFFF;
+            if ((int)alpha < alpha_threshold) continue;
+
+            u32 weight = weight_by_alpha ? alpha : 1;
+            if (!weight) continue;
+
+            u32 slot = (color*2654435761u) & table_mask;
+            for (;;) {
+                u32 index = table[slot];
+                if (index == empty_slot) {
+                    table[slot] = (u32)result.count;
+                    result.colors[result.count] = color;
+                    result.counts[result.count] = weight;
+                    result.count++;
+                    break;
+                } else if (result.colors[index] == color) {
+                    result.counts[index] += weight;
+                    break;
+                }
+
+                slot = (slot + 1) & table_mask;
+            }
+        }
+    }
+
+    free(scratch);
+    free(table);
+
+    // A weight of 0 would leave nothing to cluster too
+    u64 total_count = 0;
+    for (int i = 0; i < result.count; i++) total_count += result.counts[i];
+    if (total_count == 0 && (alpha_threshold > 0 || weight_by_alpha)) {
+        free(result.colors);
+        free(result.counts);
+        result = build_color_histogram(sampler, 0, false);
+    }
+
+    return result;
+}
+
+inline void free_color_histogram(Color_Histogram *histogram) {
+    free(histogram->colors);
+    free(histogram->counts);
+    histogram->colors = 0;
+    histogram->counts = 0;
+    histogram->count = 0;
+}
+
+// Leaves the first count observations for the caller to fill in and zeroes
+// the padding after them
+inline Observation_Buffer allocate_observation_buffer(int count) {
+    Observation_Buffer result;
+    result.count = count;
+    result.capacity = (result.count + (SIMD_MAX_LANES - 1)) & ~(SIMD_MAX_LANES - 1);
+
+    float *memory = (float *)allocate_aligned(4*sizeof(float)*result.capacity, 64);
+    result.l = memory;
+    result.a = memory + result.capacity;
+    result.b = memory + 2*result.capacity;
+    result.weights = memory + 3*result.capacity;
+    result.total_weight = 0.0f;
+    result.fixed_l = result.fixed_a = result.fixed_b = 0;
+
+    for (int i = result.count; i < result.capacity; i++) {
+        result.l[i] = result.a[i] = result.b[i] = result.weights[i] = 0.0f;
+    }
+
+    return result;
+}
+
+// Converting to CIELAB is more expensive than a nearest-centroid search, so
+// every unique color is converted once up front rather than on every iteration
+inline Observation_Buffer convert_bitmap_to_cielab(Bitmap_Sampler sampler, int alpha_threshold, bool weight_by_alpha) {
+    Color_Histogram histogram = build_color_histogram(sampler, alpha_threshold, weight_by_alpha);
+
+    // Opaque pixels weigh 1 either way
+    float weight_scale = 1.0f;
+    if (weight_by_alpha) weight_scale = 1.0f / 255.0f;
+
+    Observation_Buffer result = allocate_observation_buffer(histogram.count);
+    for (int i = 0; i < result.count; i++) {
+        Vector3 cielab = unpack_rgba_to_cielab(histogram.colors[i]);
+        result.l[i] = cielab.x;
+        result.a[i] = cielab.y;
+        result.b[i] = cielab.z;
+        result.weights[i] = (float)histogram.counts[i]*weight_scale;
+        result.total_weight += result.weights[i];
+    }
+
+    free_color_histogram(&histogram);
+
+    return result;
+}
+
+// Builds the 16-bit planes used by the fixed-point labelling kernels. They
+// take 6 bytes per observation on top of the 16 the float planes and weights
+// take, but an assignment pass only has to stream the 6. The widest kernel
+// reads FIXED_SIMD_MAX_LANES at a time, so these planes are padded further.
+inline void quantize_observations(Observation_Buffer *observations) {
+    int capacity = (observations->count + (FIXED_SIMD_MAX_LANES - 1)) & ~(FIXED_SIMD_MAX_LANES - 1);
+
+    s16 *memory = (s16 *)allocate_aligned(3*sizeof(s16)*capacity, 64);
+    observations->fixed_l = memory;
+    observations->fixed_a = memory + capacity;
+    observations->fixed_b = memory + 2*capacity;
+
+    int i = 0;
+    for (; i < observations->count; i++) {
+        observations->fixed_l[i] = cielab_to_fixed(observations->l[i]);
+        observations->fixed_a[i] = cielab_to_fixed(observations->a[i]);
+        observations->fixed_b[i] = cielab_to_fixed(observations->b[i]);
+    }
+
+    for (; i < capacity; i++) {
+        observations->fixed_l[i] = observations->fixed_a[i] = observations->fixed_b[i] = 0;
+    }
+}
+
+inline void free_fixed_observations(Observation_Buffer *observations) {
+    free_aligned(observations->fixed_l);
+    observations->fixed_l = observations->fixed_a = observations->fixed_b = 0;
+}
+
+inline void free_observation_buffer(Observation_Buffer *buffer) {
+    free_fixed_observations(buffer);
+    free_aligned(buffer->l);
+    buffer->l = buffer->a = buffer->b = buffer->weights = 0;
+    buffer->count = buffer->capacity = 0;
+    buffer->total_weight = 0.0f;
+}
+
+inline Vector3 get_observation(Observation_Buffer observations, int index) {
+    assert(0 <= index && index < observations.count);
+    Vector3 result = V3(observations.l[index], observations.a[index], observations.b[index]);
+
+    return result;
+}
+
+inline void recalculate_cluster_centroids(KMeans_Cluster *clusters, int cluster_count) {
+    for (int i = 0; i < cluster_count; i++) {
+        KMeans_Cluster *cluster = &clusters[i];
+
+        // It's erroneous to assert that cluster->observation_weight is nonzero,
+        // see: https://stackoverflow.com/a/54821667. The iterative methods
+        // reseed empty clusters before getting here; any that are still empty
+        // (because every observation already sits on a centroid) stay put.
+
+        if (cluster->observation_weight > 0.0f) {
+            cluster->centroid = cluster->observation_sum*(1.0f / cluster->observation_weight);
+        }
+    }
+}
+
+// Observations are processed in fixed-size chunks so a pass can be spread
+// across a thread pool. Each chunk accumulates into its own partial sums, and
+// the partials are merged in chunk order, so the palette doesn't depend on how
+// many threads ran the pass.
+#define KMEANS_CHUNK_SIZE 4096
+
+// An observation's error is its weighted squared distance to its centroid.
+// Each chunk keeps its highest-error observations, highest first, so that
+// clusters left empty by a pass can be reseeded. They're only collected after
+// a pass that actually leaves a cluster empty.
+struct Reseed_Candidate {
+    float error;
+    int observation_index;
+};
+
+// Cluster sums are kept in double precision across passes. After the first
+// full pass, a pass only adds the observations whose label changed to their
+// new cluster and takes them away from their old one, so once the labels
+// settle the update step costs next to nothing. Each chunk's changes are
+// summed into its own partial (l, a, b and weight for every cluster) and
+// added to the running sums in chunk order.
+struct KMeans_Partial {
+    double *sum_deltas;
+    float changed_weight;
+
+    Reseed_Candidate *reseed_candidates;
+    int reseed_candidate_count;
+};
+
+// Per-group results of labelling one observation with Yinyang bounds
+struct Yinyang_Group_Scratch {
+    bool examined;
+    float closest_dist_squared;
+    float second_closest_dist_squared;
+    int closest_cluster_index;
+};
+
+struct KMeans_Run {
+    KMeans_Cluster *clusters;
+    int cluster_count;
+    Observation_Buffer observations;
+    u8 *prev_cluster_indices;
+    int iteration;
+
+    int chunk_count;
+    KMeans_Partial *partials;
+    double *cluster_sums;
+    bool incremental;
+
+    Vector3 *prev_centroids;
+    Vector3 *prev_prev_centroids;
+    float *centroid_shifts;
+    float max_shift;
+    float second_max_shift;
+    int max_shift_index;
+    int update_count;
+    bool oscillating;
+
+    int reseed_count;
+    bool relabel_exhaustively;
+
+    Label_Observations_Kernel *label_observations;
+    Centroid_Block centroids;
+
+    Label_Fixed_Observations_Kernel *label_fixed_observations;
+    Fixed_Centroid_Block fixed_centroids;
+
+    bool elkan;
+    float *upper_bounds;
+    float *lower_bounds;
+    float *half_separations;
+    float *half_centroid_dists;
+    bool *candidates;
+
+    bool yinyang;
+    int group_count;
+    int *group_firsts;
+    int *group_members;
+    int *cluster_groups;
+    float *global_lower_bounds;
+    int *bound_updates;
+    double *cumulative_group_shifts;
+    int cumulative_group_shift_capacity;
+    Yinyang_Group_Scratch *group_scratch;
+};
+
+inline void begin_kmeans_run(KMeans_Run *run, KMeans_Cluster *clusters, int cluster_count,
+                             Observation_Buffer observations, u8 *prev_cluster_indices) {
+    *run = {};
+    run->clusters = clusters;
+    run->cluster_count = cluster_count;
+    run->observations = observations;
+    run->prev_cluster_indices = prev_cluster_indices;
+
+    run->chunk_count = (observations.count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+    run->partials = (KMeans_Partial *)malloc(sizeof(KMeans_Partial)*run->chunk_count);
+    for (int i = 0; i < run->chunk_count; i++) {
+        KMeans_Partial *partial = &run->partials[i];
+        partial->sum_deltas = (double *)malloc(sizeof(double)*4*cluster_count);
+        partial->changed_weight = 0.0f;
+        partial->reseed_candidates = (Reseed_Candidate *)malloc(sizeof(Reseed_Candidate)*cluster_count);
+        partial->reseed_candidate_count = 0;
+    }
+
+    run->cluster_sums = (double *)malloc(sizeof(double)*4*cluster_count);
+    run->incremental = false;
+
+    run->prev_centroids = (Vector3 *)malloc(sizeof(Vector3)*cluster_count);
+    run->prev_prev_centroids = (Vector3 *)malloc(sizeof(Vector3)*cluster_count);
+    run->centroid_shifts = (float *)malloc(sizeof(float)*cluster_count);
+}
+
+inline void end_kmeans_run(KMeans_Run *run) {
+    for (int i = 0; i < run->chunk_count; i++) {
+        free(run->partials[i].sum_deltas);
+        free(run->partials[i].reseed_candidates);
+    }
+    free(run->partials);
+    run->partials = 0;
+    free(run->cluster_sums);
+
+    free(run->centroid_shifts);
+    free(run->prev_prev_centroids);
+    free(run->prev_centroids);
+}
+
+inline void clear_partial(KMeans_Partial *partial, int cluster_count) {
+    for (int j = 0; j < 4*cluster_count; j++) {
+        partial->sum_deltas[j] = 0.0;
+    }
+    partial->changed_weight = 0.0f;
+    partial->reseed_candidate_count = 0;
+}
+
+inline void add_observation_to_sums(double *sums, Observation_Buffer observations, int index, u32 cluster_index,
+                                    double sign) {
+    double weight = sign*(double)observations.weights[index];
+    double *sum = &sums[4*cluster_index];
+    sum[0] += weight*(double)observations.l[index];
+    sum[1] += weight*(double)observations.a[index];
+    sum[2] += weight*(double)observations.b[index];
+    sum[3] += weight;
+}
+
+// Records the label an assignment pass gave an observation
+inline void accumulate_observation(KMeans_Run *run, KMeans_Partial *partial, int index, u32 cluster_index) {
+    bool has_prev_label = run->incremental || run->iteration > 0;
+    u32 prev_cluster_index = has_prev_label ? run->prev_cluster_indices[index] : cluster_index;
+    if (!run->incremental) {
+        add_observation_to_sums(partial->sum_deltas, run->observations, index, cluster_index, 1.0);
+    } else if (cluster_index != prev_cluster_index) {
+        add_observation_to_sums(partial->sum_deltas, run->observations, index, prev_cluster_index, -1.0);
+        add_observation_to_sums(partial->sum_deltas, run->observations, index, cluster_index, 1.0);
+    }
+
+    if (run->iteration > 0 && cluster_index != prev_cluster_index) {
+        partial->changed_weight += run->observations.weights[index];
+    }
+    run->prev_cluster_indices[index] = (u8)cluster_index;
+}
+
+inline void store_cluster_sums(KMeans_Run *run) {
+    for (int j = 0; j < run->cluster_count; j++) {
+        double *sum = &run->cluster_sums[4*j];
+        run->clusters[j].observation_sum = V3((float)sum[0], (float)sum[1], (float)sum[2]);
+        run->clusters[j].observation_weight = (float)sum[3];
+    }
+}
+
+// Refills each chunk's reseed candidates with its highest-error
+// observations under the labels of the last pass. merge_partials() only calls
+// this after a pass that leaves a cluster empty. Ties keep the earlier
+// observation, so the candidates don't depend on anything but the chunk's
+// contents.
+inline void collect_reseed_candidates(KMeans_Run *run) {
+    Observation_Buffer observations = run->observations;
+    for (int chunk_index = 0; chunk_index < run->chunk_count; chunk_index++) {
+        KMeans_Partial *partial = &run->partials[chunk_index];
+        partial->reseed_candidate_count = 0;
+
+        int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+        int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, observations.count);
+        for (int i = chunk_first; i < chunk_end; i++) {
+            Vector3 centroid = run->clusters[run->prev_cluster_indices[i]].centroid;
+            float error = observations.weights[i]*cielab_distance_squared(observations.l[i], observations.a[i],
+                                                                          observations.b[i], centroid.x,
+                                                                          centroid.y, centroid.z);
+            int count = partial->reseed_candidate_count;
+            if (error > 0.0f && (count < run->cluster_count || error > partial->reseed_candidates[count - 1].error)) {
+                int slot = (count < run->cluster_count) ? count++ : count - 1;
+                while (slot > 0 && error > partial->reseed_candidates[slot - 1].error) {
+                    partial->reseed_candidates[slot] = partial->reseed_candidates[slot - 1];
+                    slot--;
+                }
+
+                partial->reseed_candidates[slot].error = error;
+                partial->reseed_candidates[slot].observation_index = i;
+                partial->reseed_candidate_count = count;
+            }
+        }
+    }
+}
+
+// Folds the partials of the pass into the cluster sums (replacing them after
+// a full pass) and returns the total weight of observations whose label
+// changed
+inline float merge_partials(KMeans_Run *run) {
+    float result = 0.0f;
+
+    if (!run->incremental) {
+        for (int j = 0; j < 4*run->cluster_count; j++) {
+            run->cluster_sums[j] = 0.0;
+        }
+    }
+
+    for (int i = 0; i < run->chunk_count; i++) {
+        KMeans_Partial *partial = &run->partials[i];
+        for (int j = 0; j < 4*run->cluster_count; j++) {
+            run->cluster_sums[j] += partial->sum_deltas[j];
+        }
+
+        result += partial->changed_weight;
+    }
+
+    run->incremental = true;
+    store_cluster_sums(run);
+
+    for (int j = 0; j < run->cluster_count; j++) {
+        if (run->clusters[j].observation_weight <= 0.0f) {
+            collect_reseed_candidates(run);
+            break;
+        }
+    }
+
+    return result;
+}
+
+// Any cluster left empty by the last pass would otherwise keep a centroid no
+// observation is closest to. Instead, each one (in order) takes over the
+// highest-error observation left across all chunks, as long as that doesn't
+// empty the cluster it's taken from.
+inline void reseed_empty_clusters(KMeans_Run *run) {
+    run->reseed_count = 0;
+    int *candidate_heads = 0;
+    for (int j = 0; j < run->cluster_count; j++) {
+        if (run->clusters[j].observation_weight > 0.0f) continue;
+
+        if (!candidate_heads) {
+            candidate_heads = (int *)calloc(run->chunk_count, sizeof(int));
+        }
+
+        for (;;) {
+            int best_chunk_index = -1;
+            float best_error = 0.0f;
+            for (int i = 0; i < run->chunk_count; i++) {
+                KMeans_Partial *partial = &run->partials[i];
+                if (candidate_heads[i] < partial->reseed_candidate_count &&
+                    partial->reseed_candidates[candidate_heads[i]].error > best_error) {
+                    best_error = partial->reseed_candidates[candidate_heads[i]].error;
+                    best_chunk_index = i;
+                }
+            }
+            if (best_chunk_index < 0) break;
+
+            KMeans_Partial *partial = &run->partials[best_chunk_index];
+            int observation_index = partial->reseed_candidates[candidate_heads[best_chunk_index]++].observation_index;
+
+            u32 donor_index = run->prev_cluster_indices[observation_index];
+            if (run->cluster_sums[4*donor_index + 3] - run->observations.weights[observation_index] > 0.0) {
+                add_observation_to_sums(run->cluster_sums, run->observations, observation_index, donor_index, -1.0);
+                add_observation_to_sums(run->cluster_sums, run->observations, observation_index, (u32)j, 1.0);
+                run->prev_cluster_indices[observation_index] = (u8)j;
+
+                run->reseed_count++;
+                break;
+            }
+        }
+    }
+    free(candidate_heads);
+
+    if (run->reseed_count > 0) store_cluster_sums(run);
+}
+
+// Whether the last pass left a cluster empty that reseed_empty_clusters()
+// might be able to fill
+inline bool has_empty_clusters(KMeans_Run *run) {
+    bool any_candidates = false;
+    for (int i = 0; i < run->chunk_count; i++) {
+        any_candidates = any_candidates || (run->partials[i].reseed_candidate_count > 0);
+    }
+
+    bool result = false;
+    for (int j = 0; j < run->cluster_count && any_candidates; j++) {
+        if (run->clusters[j].observation_weight <= 0.0f) {
+            result = true;
+            break;
+        }
+    }
+
+    return result;
+}
+
+// Reseeds empty clusters, moves every centroid to the mean of its
+// observations and records how far each one moved. Returns true once the
+// total movement is within tolerance or the centroids have returned to where
+// they were two updates ago, in which case the labels would just flip back
+// and forth from here on.
+inline bool update_centroids(KMeans_Run *run, float tolerance) {
+    int cluster_count = run->cluster_count;
+    KMeans_Cluster *clusters = run->clusters;
+
+    Vector3 *swap = run->prev_prev_centroids;
+    run->prev_prev_centroids = run->prev_centroids;
+    run->prev_centroids = swap;
+    for (int j = 0; j < cluster_count; j++) {
+        run->prev_centroids[j] = clusters[j].centroid;
+    }
+
+    reseed_empty_clusters(run);
+    run->relabel_exhaustively = (run->reseed_count > 0);
+
+    recalculate_cluster_centroids(clusters, cluster_count);
+    run->update_count++;
+
+    float total_shift = 0.0f;
+    run->max_shift = 0.0f;
+    run->second_max_shift = 0.0f;
+    run->max_shift_index = 0;
+    for (int j = 0; j < cluster_count; j++) {
+        Vector3 c = clusters[j].centroid;
+        Vector3 prev_c = run->prev_centroids[j];
+        float shift = sqrt(cielab_distance_squared(c.x, c.y, c.z, prev_c.x, prev_c.y, prev_c.z));
+        run->centroid_shifts[j] = shift;
+        total_shift += shift;
+
+        if (shift > run->max_shift) {
+            run->second_max_shift = run->max_shift;
+            run->max_shift = shift;
+            run->max_shift_index = j;
+        } else if (shift > run->second_max_shift) {
+            run->second_max_shift = shift;
+        }
+    }
+
+    bool result = total_shift <= tolerance;
+    if (!result && run->update_count >= 2) {
+        run->oscillating = true;
+        for (int j = 0; j < cluster_count; j++) {
+            Vector3 c = clusters[j].centroid;
+            Vector3 prev_prev_c = run->prev_prev_centroids[j];
+            if (c.x != prev_prev_c.x || c.y != prev_prev_c.y || c.z != prev_prev_c.z) {
+                run->oscillating = false;
+                break;
+            }
+        }
+
+        result = run->oscillating;
+    }
+
+    return result;
+}
+
+inline void lloyd_assignment_task(void *data, int chunk_index) {
+    KMeans_Run *run = (KMeans_Run *)data;
+    KMeans_Partial *partial = &run->partials[chunk_index];
+    clear_partial(partial, run->cluster_count);
+
+    int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+    int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, run->observations.count);
+
+    // Observations are labelled a block at a time so the labels are still in
+    // cache when they're compared and folded into the partial sums
+    const int block_size = 256;
+    u32 labels[block_size];
+
+    for (int first = chunk_first; first < chunk_end; first += block_size) {
+        int count = minimum(block_size, chunk_end - first);
+        if (run->label_fixed_observations) {
+            run->label_fixed_observations(run->observations, first, count, run->fixed_centroids, labels);
+        } else {
+            run->label_observations(run->observations, first, count, run->centroids, labels);
+        }
+
+        for (int i = 0; i < count; i++) {
+            u32 closest_cluster_index = labels[i];
+            assert(closest_cluster_index < (u32)run->cluster_count);
+
+            accumulate_observation(run, partial, first + i, closest_cluster_index);
+        }
+    }
+}
+
+// Every iterative method stops after an assignment pass that changes the
+// labels of no more than config->min_change_fraction of the total weight
+// (with the default of zero, only once no label changes) and leaves no
+// cluster to reseed, after config->max_iterations passes, or when
+// update_centroids() says to
+inline bool assignment_pass_converged(KMeans_Run *run, float changed_weight, Palettize_Config *config) {
+    bool result = run->iteration > 0 &&
+                  changed_weight <= config->min_change_fraction*run->observations.total_weight &&
+                  !has_empty_clusters(run);
+
+    return result;
+}
+
+inline KMeans_Result cluster_observations_lloyd(KMeans_Cluster *clusters, int cluster_count,
+                                                Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                Palettize_Config *config, Thread_Pool *pool) {
+    KMeans_Result result = {};
+
+    KMeans_Run run;
+    begin_kmeans_run(&run, clusters, cluster_count, observations, prev_cluster_indices);
+
+    // Quantized observations are labelled with the fixed-point kernels, but
+    // the centroids are still averaged from the float planes
+    bool fixed_point = (observations.fixed_l != 0);
+    if (fixed_point) {
+        run.label_fixed_observations = get_label_fixed_observations_kernel(query_simd_level());
+        allocate_fixed_centroid_block(&run.fixed_centroids, cluster_count);
+    } else {
+        run.label_observations = get_label_observations_kernel(query_simd_level());
+        allocate_centroid_block(&run.centroids, cluster_count);
+    }
+
+    for (run.iteration = 0;; run.iteration++) {
+        if (fixed_point) {
+            pack_fixed_centroid_block(&run.fixed_centroids, clusters, cluster_count);
+        } else {
+            pack_centroid_block(&run.centroids, clusters, cluster_count);
+        }
+        run_parallel(pool, run.chunk_count, lloyd_assignment_task, &run);
+
+        float changed_weight = merge_partials(&run);
+        result.iteration_count = run.iteration + 1;
+        if (assignment_pass_converged(&run, changed_weight, config)) {
+            result.converged = true;
+            break;
+        }
+        if (result.iteration_count >= config->max_iterations) break;
+
+        if (update_centroids(&run, config->tolerance)) {
+            result.converged = !run.oscillating;
+            break;
+        }
+    }
+
+    if (fixed_point) {
+        free_fixed_centroid_block(&run.fixed_centroids);
+    } else {
+        free_centroid_block(&run.centroids);
+    }
+    end_kmeans_run(&run);
+
+    return result;
+}
+
+// The bounded methods carry distance bounds between iterations and skip any
+// centroid that the triangle inequality rules out (Hamerly keeps one lower
+// bound per observation, Elkan keeps one per observation and centroid, and
+// Yinyang keeps one per observation and group of centroids). A
+// bound only prunes when it clears the upper bound by a relative and absolute
+// margin that's far wider than float rounding, so every observation gets
+// exactly the label an exhaustive search would give it and the palette is
+// identical to cluster_observations_lloyd().
+#define BOUND_RELATIVE_SLACK 1e-4f
+#define BOUND_ABSOLUTE_SLACK 1e-3f
+
+inline bool bound_prunes(float upper_bound, float lower_bound) {
+    bool result = upper_bound*(1.0f + BOUND_RELATIVE_SLACK) + BOUND_ABSOLUTE_SLACK < lower_bound;
+
+    return result;
+}
+
+inline float centroid_distance(KMeans_Cluster *a, KMeans_Cluster *b) {
+    float result = sqrt(cielab_distance_squared(a->centroid.x, a->centroid.y, a->centroid.z,
+                                                b->centroid.x, b->centroid.y, b->centroid.z));
+
+    return result;
+}
+
+inline float observation_distance(Observation_Buffer observations, int index, KMeans_Cluster *cluster) {
+    float result = sqrt(cielab_distance_squared(observations.l[index], observations.a[index], observations.b[index],
+                                                cluster->centroid.x, cluster->centroid.y, cluster->centroid.z));
+
+    return result;
+}
+
+// Exhaustive search over every centroid for one observation, in the same order
+// and with the same tie-breaking as the labelling kernels. Distances to every
+// centroid are written out when the caller tracks per-centroid bounds.
+inline u32 label_observation_exhaustively(KMeans_Cluster *clusters, int cluster_count,
+                                          Observation_Buffer observations, int index,
+                                          float *closest_dist, float *second_closest_dist,
+                                          float *dists) {
+    float closest_dist_squared = FLOAT_MAX;
+    float second_closest_dist_squared = FLOAT_MAX;
+    u32 closest_cluster_index = 0;
+
+    for (int j = 0; j < cluster_count; j++) {
+        Vector3 centroid = clusters[j].centroid;
+        float d = cielab_distance_squared(observations.l[index], observations.a[index], observations.b[index],
+                                          centroid.x, centroid.y, centroid.z);
+        if (dists) dists[j] = sqrt(d);
+
+        if (d < closest_dist_squared) {
+            second_closest_dist_squared = closest_dist_squared;
+            closest_dist_squared = d;
+            closest_cluster_index = (u32)j;
+        } else if (d < second_closest_dist_squared) {
+            second_closest_dist_squared = d;
+        }
+    }
+
+    *closest_dist = sqrt(closest_dist_squared);
+    *second_closest_dist = sqrt(second_closest_dist_squared);
+
+    return closest_cluster_index;
+}
+
+inline u32 label_observation_with_bounds(KMeans_Run *run, int i, bool *candidates) {
+    KMeans_Cluster *clusters = run->clusters;
+    int cluster_count = run->cluster_count;
+    Observation_Buffer observations = run->observations;
+    bool elkan = run->elkan;
+    float *lower_bound = &run->lower_bounds[elkan ? i*cluster_count : i];
+
+    if (run->iteration == 0 || run->relabel_exhaustively) {
+        float closest_dist, second_closest_dist;
+        u32 result = label_observation_exhaustively(clusters, cluster_count, observations, i,
+                                                    &closest_dist, &second_closest_dist,
+                                                    elkan ? lower_bound : 0);
+        run->upper_bounds[i] = closest_dist;
+        if (!elkan) *lower_bound = second_closest_dist;
+
+        return result;
+    }
+
+    u32 result = run->prev_cluster_indices[i];
+
+    float global_lower_bound = run->half_separations[result];
+    if (!elkan) global_lower_bound = maximum(global_lower_bound, *lower_bound);
+    if (bound_prunes(run->upper_bounds[i], global_lower_bound)) return result;
+
+    // Tighten the upper bound before giving up on pruning
+    run->upper_bounds[i] = observation_distance(observations, i, &clusters[result]);
+    if (elkan) lower_bound[result] = run->upper_bounds[i];
+    if (bound_prunes(run->upper_bounds[i], global_lower_bound)) return result;
+
+    if (elkan) {
+        // Any centroid the bounds can't rule out is a candidate, and the
+        // label is the first closest candidate so ties resolve like a full
+        // search
+        float *half_dists = &run->half_centroid_dists[result*cluster_count];
+        for (int j = 0; j < cluster_count; j++) {
+            candidates[j] = (j == (int)result) ||
+                            !(bound_prunes(run->upper_bounds[i], lower_bound[j]) ||
+                              bound_prunes(run->upper_bounds[i], half_dists[j]));
+        }
+
+        float closest_dist_squared = FLOAT_MAX;
+        for (int j = 0; j < cluster_count; j++) {
+            if (!candidates[j]) continue;
+
+            Vector3 centroid = clusters[j].centroid;
+            float d = cielab_distance_squared(observations.l[i], observations.a[i], observations.b[i],
+                                              centroid.x, centroid.y, centroid.z);
+            lower_bound[j] = sqrt(d);
+            if (d < closest_dist_squared) {
+                closest_dist_squared = d;
+                result = (u32)j;
+            }
+        }
+        run->upper_bounds[i] = sqrt(closest_dist_squared);
+    } else {
+        float closest_dist, second_closest_dist;
+        result = label_observation_exhaustively(clusters, cluster_count, observations, i,
+                                                &closest_dist, &second_closest_dist, 0);
+        run->upper_bounds[i] = closest_dist;
+        *lower_bound = second_closest_dist;
+    }
+
+    return result;
+}
+
+// Yinyang k-means (Ding et al., "Yinyang K-Means: A Drop-In Replacement of
+// the Classic K-Means with Consistent Speedup"). The centroids are split once
+// into about k/10 groups, and each observation keeps a lower bound on its
+// distance to every centroid of each group except its own. A group whose
+// bound clears the upper bound is skipped whole, so the cost per observation
+// grows with the number of groups that are actually close rather than with k.
+//
+// Each observation also keeps the minimum of its group bounds, loosened by the
+// largest centroid shift every update, and most observations are settled by
+// that alone. The group bounds are only brought up to date when it fails, by
+// subtracting how far each group has drifted since they were last touched.
+#define YINYANG_CLUSTERS_PER_GROUP 10
+#define YINYANG_GROUPING_ITERATIONS 5
+
+// Groups the starting centroids with a few Lloyd iterations of their own,
+// seeded from evenly spaced centroids. Empty groups are dropped.
+inline void group_centroids(KMeans_Run *run) {
+    KMeans_Cluster *clusters = run->clusters;
+    int cluster_count = run->cluster_count;
+    int group_count = (cluster_count + (YINYANG_CLUSTERS_PER_GROUP - 1)) / YINYANG_CLUSTERS_PER_GROUP;
+
+    Vector3 *group_centers = (Vector3 *)malloc(sizeof(Vector3)*group_count);
+    Vector3 *group_sums = (Vector3 *)malloc(sizeof(Vector3)*group_count);
+    int *group_sizes = (int *)malloc(sizeof(int)*group_count);
+    for (int g = 0; g < group_count; g++) {
+        group_centers[g] = clusters[(g*cluster_count) / group_count].centroid;
+    }
+
+    for (int iteration = 0; iteration < YINYANG_GROUPING_ITERATIONS; iteration++) {
+        for (int g = 0; g < group_count; g++) {
+            group_sums[g] = V3i(0, 0, 0);
+            group_sizes[g] = 0;
+        }
+
+        for (int j = 0; j < cluster_count; j++) {
+            Vector3 c = clusters[j].centroid;
+            float closest_dist_squared = FLOAT_MAX;
+            int closest_group = 0;
+            for (int g = 0; g < group_count; g++) {
+                float d = cielab_distance_squared(c.x, c.y, c.z, group_centers[g].x, group_centers[g].y,
+                                                  group_centers[g].z);
+                if (d < closest_dist_squared) {
+                    closest_dist_squared = d;
+                    closest_group = g;
+                }
+            }
+
+            run->cluster_groups[j] = closest_group;
+            group_sums[closest_group] += c;
+            group_sizes[closest_group]++;
+        }
+
+        for (int g = 0; g < group_count; g++) {
+            if (group_sizes[g] > 0) group_centers[g] = group_sums[g]*(1.0f / (float)group_sizes[g]);
+        }
+    }
+
+    // Renumber the non-empty groups and list their members in index order
+    int *group_remap = group_sizes;
+    run->group_count = 0;
+    for (int g = 0; g < group_count; g++) {
+        group_remap[g] = (group_sizes[g] > 0) ? run->group_count++ : -1;
+    }
+
+    int member_count = 0;
+    for (int g = 0; g < run->group_count; g++) {
+        run->group_firsts[g] = member_count;
+        for (int j = 0; j < cluster_count; j++) {
+            if (group_remap[run->cluster_groups[j]] == g) {
+                run->group_members[member_count++] = j;
+            }
+        }
+    }
+    run->group_firsts[run->group_count] = member_count;
+
+    for (int j = 0; j < cluster_count; j++) {
+        run->cluster_groups[j] = group_remap[run->cluster_groups[j]];
+    }
+
+    free(group_sizes);
+    free(group_sums);
+    free(group_centers);
+}
+
+inline u32 label_observation_yinyang(KMeans_Run *run, int i, Yinyang_Group_Scratch *groups) {
+    KMeans_Cluster *clusters = run->clusters;
+    Observation_Buffer observations = run->observations;
+    int group_count = run->group_count;
+    float *lower_bound = &run->lower_bounds[i*group_count];
+    bool exhaustive = (run->iteration == 0 || run->relabel_exhaustively);
+
+    u32 result = exhaustive ? 0 : run->prev_cluster_indices[i];
+    float closest_dist_squared = FLOAT_MAX;
+
+    u32 prev_cluster_index = result;
+    float prev_dist = 0.0f;
+    if (!exhaustive) {
+        float half_separation = run->half_separations[result];
+        float global_lower_bound = maximum(run->global_lower_bounds[i], half_separation);
+        if (bound_prunes(run->upper_bounds[i], global_lower_bound)) return result;
+
+        // Tighten the upper bound before giving up on pruning
+        Vector3 centroid = clusters[result].centroid;
+        closest_dist_squared = cielab_distance_squared(observations.l[i], observations.a[i], observations.b[i],
+                                                       centroid.x, centroid.y, centroid.z);
+        prev_dist = sqrt(closest_dist_squared);
+        run->upper_bounds[i] = prev_dist;
+        if (bound_prunes(prev_dist, global_lower_bound)) return result;
+
+        // Bring the group bounds up to date, which can only tighten the
+        // global bound
+        double *shifts_then = &run->cumulative_group_shifts[run->bound_updates[i]*group_count];
+        double *shifts_now = &run->cumulative_group_shifts[run->update_count*group_count];
+        global_lower_bound = FLOAT_MAX;
+        for (int g = 0; g < group_count; g++) {
+            lower_bound[g] = maximum(0.0f, lower_bound[g] - (float)(shifts_now[g] - shifts_then[g]));
+            global_lower_bound = minimum(global_lower_bound, lower_bound[g]);
+        }
+        run->bound_updates[i] = run->update_count;
+        run->global_lower_bounds[i] = global_lower_bound;
+
+        global_lower_bound = maximum(global_lower_bound, half_separation);
+        if (bound_prunes(prev_dist, global_lower_bound)) return result;
+    }
+
+    for (int g = 0; g < group_count; g++) {
+        Yinyang_Group_Scratch *group = &groups[g];
+        group->examined = exhaustive || !bound_prunes(sqrt(closest_dist_squared), lower_bound[g]);
+        if (!group->examined) continue;
+
+        group->closest_dist_squared = FLOAT_MAX;
+        group->second_closest_dist_squared = FLOAT_MAX;
+        group->closest_cluster_index = -1;
+        for (int m = run->group_firsts[g]; m < run->group_firsts[g + 1]; m++) {
+            int j = run->group_members[m];
+            Vector3 centroid = clusters[j].centroid;
+            float d = cielab_distance_squared(observations.l[i], observations.a[i], observations.b[i],
+                                              centroid.x, centroid.y, centroid.z);
+            if (d < group->closest_dist_squared) {
+                group->second_closest_dist_squared = group->closest_dist_squared;
+                group->closest_dist_squared = d;
+                group->closest_cluster_index = j;
+            } else if (d < group->second_closest_dist_squared) {
+                group->second_closest_dist_squared = d;
+            }
+
+            // Groups aren't visited in index order, so ties are broken
+            // explicitly to match a full search
+            if (d < closest_dist_squared || (d == closest_dist_squared && (u32)j < result)) {
+                closest_dist_squared = d;
+                result = (u32)j;
+            }
+        }
+    }
+
+    float global_lower_bound = FLOAT_MAX;
+    for (int g = 0; g < group_count; g++) {
+        Yinyang_Group_Scratch *group = &groups[g];
+        if (group->examined) {
+            bool owns_result = (group->closest_cluster_index == (int)result);
+            lower_bound[g] = sqrt(owns_result ? group->second_closest_dist_squared : group->closest_dist_squared);
+        } else if (g == run->cluster_groups[prev_cluster_index] && result != prev_cluster_index) {
+            lower_bound[g] = minimum(lower_bound[g], prev_dist);
+        }
+        global_lower_bound = minimum(global_lower_bound, lower_bound[g]);
+    }
+    run->upper_bounds[i] = sqrt(closest_dist_squared);
+    run->global_lower_bounds[i] = global_lower_bound;
+    run->bound_updates[i] = run->update_count;
+
+    return result;
+}
+
+inline void bounded_assignment_task(void *data, int chunk_index) {
+    KMeans_Run *run = (KMeans_Run *)data;
+    KMeans_Partial *partial = &run->partials[chunk_index];
+    clear_partial(partial, run->cluster_count);
+
+    bool *candidates = run->elkan ? &run->candidates[chunk_index*run->cluster_count] : 0;
+    Yinyang_Group_Scratch *groups = run->yinyang ? &run->group_scratch[chunk_index*run->group_count] : 0;
+
+    int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+    int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, run->observations.count);
+    for (int i = chunk_first; i < chunk_end; i++) {
+        u32 closest_cluster_index = run->yinyang ? label_observation_yinyang(run, i, groups)
+                                                 : label_observation_with_bounds(run, i, candidates);
+        assert(closest_cluster_index < (u32)run->cluster_count);
+
+        // Labels match the exhaustive search, so the changes and therefore
+        // the centroid sums do too, bit for bit
+        accumulate_observation(run, partial, i, closest_cluster_index);
+    }
+}
+
+inline void update_bounds_task(void *data, int chunk_index) {
+    KMeans_Run *run = (KMeans_Run *)data;
+    int cluster_count = run->cluster_count;
+
+    int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+    int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, run->observations.count);
+    for (int i = chunk_first; i < chunk_end; i++) {
+        u32 cluster_index = run->prev_cluster_indices[i];
+        run->upper_bounds[i] += run->centroid_shifts[cluster_index];
+
+        if (run->elkan) {
+            float *lower_bound = &run->lower_bounds[i*cluster_count];
+            for (int j = 0; j < cluster_count; j++) {
+                lower_bound[j] = maximum(0.0f, lower_bound[j] - run->centroid_shifts[j]);
+            }
+        } else if (run->yinyang) {
+            run->global_lower_bounds[i] = maximum(0.0f, run->global_lower_bounds[i] - run->max_shift);
+        } else {
+            float shift = ((int)cluster_index == run->max_shift_index) ? run->second_max_shift : run->max_shift;
+            run->lower_bounds[i] = maximum(0.0f, run->lower_bounds[i] - shift);
+        }
+    }
+}
+
+inline KMeans_Result cluster_observations_bounded(KMeans_Cluster *clusters, int cluster_count,
+                                                  Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                  Cluster_Method method, Palettize_Config *config,
+                                                  Thread_Pool *pool) {
+    KMeans_Result result = {};
+
+    KMeans_Run run;
+    begin_kmeans_run(&run, clusters, cluster_count, observations, prev_cluster_indices);
+
+    run.elkan = (method == CLUSTER_METHOD_ELKAN);
+    run.yinyang = (method == CLUSTER_METHOD_YINYANG);
+    bool elkan = run.elkan;
+    if (run.yinyang) {
+        run.group_firsts = (int *)malloc(sizeof(int)*(cluster_count + 1));
+        run.group_members = (int *)malloc(sizeof(int)*cluster_count);
+        run.cluster_groups = (int *)malloc(sizeof(int)*cluster_count);
+        group_centroids(&run);
+        run.global_lower_bounds = (float *)malloc(sizeof(float)*observations.count);
+        run.bound_updates = (int *)malloc(sizeof(int)*observations.count);
+        run.cumulative_group_shift_capacity = 64;
+        run.cumulative_group_shifts = (double *)malloc(sizeof(double)*run.group_count*run.cumulative_group_shift_capacity);
+        for (int g = 0; g < run.group_count; g++) {
+            run.cumulative_group_shifts[g] = 0.0;
+        }
+        run.group_scratch = (Yinyang_Group_Scratch *)malloc(sizeof(Yinyang_Group_Scratch)*run.group_count*run.chunk_count);
+    }
+
+    int lower_bound_count = elkan ? cluster_count : run.yinyang ? run.group_count : 1;
+    run.upper_bounds = (float *)malloc(sizeof(float)*observations.count);
+    run.lower_bounds = (float *)malloc(sizeof(float)*observations.count*lower_bound_count);
+    run.half_separations = (float *)malloc(sizeof(float)*cluster_count);
+    if (elkan) {
+        run.half_centroid_dists = (float *)malloc(sizeof(float)*cluster_count*cluster_count);
+        run.candidates = (bool *)malloc(sizeof(bool)*cluster_count*run.chunk_count);
+    }
+
+    for (run.iteration = 0;; run.iteration++) {
+        if (run.iteration > 0) {
+            // s(j) is half the distance from centroid j to its nearest
+            // neighbour; no observation closer than that to j can be closer to
+            // any other centroid
+            for (int j = 0; j < cluster_count; j++) {
+                run.half_separations[j] = FLOAT_MAX;
+            }
+            for (int j = 0; j < cluster_count; j++) {
+                for (int k = j + 1; k < cluster_count; k++) {
+                    float half_dist = 0.5f*centroid_distance(&clusters[j], &clusters[k]);
+                    run.half_separations[j] = minimum(run.half_separations[j], half_dist);
+                    run.half_separations[k] = minimum(run.half_separations[k], half_dist);
+                    if (elkan) {
+                        run.half_centroid_dists[j*cluster_count + k] = half_dist;
+                        run.half_centroid_dists[k*cluster_count + j] = half_dist;
+                    }
+                }
+            }
+        }
+
+        run_parallel(pool, run.chunk_count, bounded_assignment_task, &run);
+
+        float changed_weight = merge_partials(&run);
+        result.iteration_count = run.iteration + 1;
+        if (assignment_pass_converged(&run, changed_weight, config)) {
+            result.converged = true;
+            break;
+        }
+        if (result.iteration_count >= config->max_iterations) break;
+
+        if (update_centroids(&run, config->tolerance)) {
+            result.converged = !run.oscillating;
+            break;
+        }
+
+        if (run.yinyang) {
+            // Row t holds how far each group has drifted over the first t
+            // centroid updates
+            if (run.update_count == run.cumulative_group_shift_capacity) {
+                run.cumulative_group_shift_capacity *= 2;
+                run.cumulative_group_shifts = (double *)realloc(run.cumulative_group_shifts,
+                                                                sizeof(double)*run.group_count*
+                                                                run.cumulative_group_shift_capacity);
+            }
+
+            double *shifts_before = &run.cumulative_group_shifts[(run.update_count - 1)*run.group_count];
+            double *shifts_after = &run.cumulative_group_shifts[run.update_count*run.group_count];
+            for (int g = 0; g < run.group_count; g++) {
+                float group_shift = 0.0f;
+                for (int m = run.group_firsts[g]; m < run.group_firsts[g + 1]; m++) {
+                    group_shift = maximum(group_shift, run.centroid_shifts[run.group_members[m]]);
+                }
+                shifts_after[g] = shifts_before[g] + group_shift;
+            }
+        }
+
+        run_parallel(pool, run.chunk_count, update_bounds_task, &run);
+    }
+
+    free(run.group_scratch);
+    free(run.cumulative_group_shifts);
+    free(run.bound_updates);
+    free(run.global_lower_bounds);
+    free(run.cluster_groups);
+    free(run.group_members);
+    free(run.group_firsts);
+    free(run.candidates);
+    free(run.half_centroid_dists);
+    free(run.half_separations);
+    free(run.lower_bounds);
+    free(run.upper_bounds);
+    end_kmeans_run(&run);
+
+    return result;
+}
+
+// Kd-tree filtering (Kanungo et al., "An Efficient k-Means Clustering
+// Algorithm: Analysis and Implementation"). A kd-tree over the observations
+// is built once per run, and every node stores the weighted moments of the
+// observations under it. Each pass walks the tree with a shrinking list of
+// candidate centroids: a candidate is dropped from a node once another one is
+// closer to every point of the node's bounding box, and when a single
+// candidate is left the whole subtree is assigned to it from its moments.
+// Pruning is conservative, so the labels match an exhaustive search; only the
+// order the sums are added in differs from Lloyd.
+//
+// No pass produces per-observation labels, so the run converges when the
+// centroids stop moving (or move less than config->tolerance) rather than by
+// counting changed labels, and config->min_change_fraction is ignored.
+#define KD_LEAF_SIZE 16
+#define KD_TASK_DEPTH 6
+
+struct KD_Node {
+    Vector3 box_min;
+    Vector3 box_max;
+
+    double weight;
+    double sum_l;
+    double sum_a;
+    double sum_b;
+    double sum_squared;
+
+    int first;
+    int count;
+
+    // Both zero for leaves, since the root is never a child
+    int children[2];
+};
+
+struct KD_Tree {
+    int node_count;
+    int node_capacity;
+    KD_Node *nodes;
+    int depth;
+
+    // The observations in tree order, so every node's observations are
+    // contiguous
+    float *l;
+    float *a;
+    float *b;
+    float *weights;
+};
+
+inline int build_kd_node(KD_Tree *tree, Observation_Buffer observations, int *indices, int first, int count,
+                         int depth) {
+    if (tree->node_count == tree->node_capacity) {
+        tree->node_capacity *= 2;
+        tree->nodes = (KD_Node *)realloc(tree->nodes, sizeof(KD_Node)*tree->node_capacity);
+    }
+
+    int result = tree->node_count++;
+    tree->depth = maximum(tree->depth, depth);
+
+    KD_Node node = {};
+    node.box_min = V3(FLOAT_MAX, FLOAT_MAX, FLOAT_MAX);
+    node.box_max = V3(-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX);
+    node.first = first;
+    node.count = count;
+    for (int i = first; i < first + count; i++) {
+        int index = indices[i];
+        float l = observations.l[index];
+        float a = observations.a[index];
+        float b = observations.b[index];
+        double weight = observations.weights[index];
+
+        node.box_min = V3(minimum(node.box_min.x, l), minimum(node.box_min.y, a), minimum(node.box_min.z, b));
+        node.box_max = V3(maximum(node.box_max.x, l), maximum(node.box_max.y, a), maximum(node.box_max.z, b));
+
+        node.weight += weight;
+        node.sum_l += weight*l;
+        node.sum_a += weight*a;
+        node.sum_b += weight*b;
+        node.sum_squared += weight*((double)l*l + (double)a*a + (double)b*b);
+    }
+
+    if (count > KD_LEAF_SIZE) {
+        // Split the widest side of the box at its midpoint
+        Vector3 extent = node.box_max - node.box_min;
+        int axis = 0;
+        if (extent.y > extent.x) axis = 1;
+        if (extent.z > ((axis == 0) ? extent.x : extent.y)) axis = 2;
+
+        float *plane = (axis == 0) ? observations.l : (axis == 1) ? observations.a : observations.b;
+        float lo = (axis == 0) ? node.box_min.x : (axis == 1) ? node.box_min.y : node.box_min.z;
+        float hi = (axis == 0) ? node.box_max.x : (axis == 1) ? node.box_max.y : node.box_max.z;
+        float split = 0.5f*(lo + hi);
+
+        int left_end = first;
+        for (int i = first; i < first + count; i++) {
+            if (plane[indices[i]] < split) {
+                int swap = indices[i];
+                indices[i] = indices[left_end];
+                indices[left_end] = swap;
+                left_end++;
+            }
+        }
+
+        // A box too thin to split stays a leaf
+        int left_count = left_end - first;
+        if (left_count > 0 && left_count < count) {
+            node.children[0] = build_kd_node(tree, observations, indices, first, left_count, depth + 1);
+            node.children[1] = build_kd_node(tree, observations, indices, left_end, count - left_count, depth + 1);
+        }
+    }
+
+    tree->nodes[result] = node;
+
+    return result;
+}
+
+inline void build_kd_tree(KD_Tree *tree, Observation_Buffer observations) {
+    tree->node_count = 0;
+    tree->node_capacity = maximum(1, 2*observations.count / KD_LEAF_SIZE);
+    tree->nodes = (KD_Node *)malloc(sizeof(KD_Node)*tree->node_capacity);
+    tree->depth = 0;
+
+    int *indices = (int *)malloc(sizeof(int)*observations.count);
+    for (int i = 0; i < observations.count; i++) {
+        indices[i] = i;
+    }
+
+    build_kd_node(tree, observations, indices, 0, observations.count, 0);
+
+    tree->l = (float *)malloc(sizeof(float)*observations.count);
+    tree->a = (float *)malloc(sizeof(float)*observations.count);
+    tree->b = (float *)malloc(sizeof(float)*observations.count);
+    tree->weights = (float *)malloc(sizeof(float)*observations.count);
+    for (int i = 0; i < observations.count; i++) {
+        tree->l[i] = observations.l[indices[i]];
+        tree->a[i] = observations.a[indices[i]];
+        tree->b[i] = observations.b[indices[i]];
+        tree->weights[i] = observations.weights[indices[i]];
+    }
+
+    free(indices);
+}
+
+inline void free_kd_tree(KD_Tree *tree) {
+    free(tree->weights);
+    free(tree->b);
+    free(tree->a);
+    free(tree->l);
+    free(tree->nodes);
+    tree->nodes = 0;
+}
+
+// Each pass is split into independent subtrees near the root, every one
+// accumulating into its own sums, and the sums are merged in tree order
+struct KD_Filter_Run {
+    KD_Tree *tree;
+    KMeans_Cluster *clusters;
+    int cluster_count;
+
+    int task_count;
+    int *task_nodes;
+    double *task_sums;
+    double *task_inertias;
+    int *task_candidates;
+};
+
+inline void collect_kd_task_nodes(KD_Filter_Run *run, int node_index, int depth) {
+    KD_Node *node = &run->tree->nodes[node_index];
+    if (depth == KD_TASK_DEPTH || !node->children[0]) {
+        if (run->task_nodes) run->task_nodes[run->task_count] = node_index;
+        run->task_count++;
+    } else {
+        collect_kd_task_nodes(run, node->children[0], depth + 1);
+        collect_kd_task_nodes(run, node->children[1], depth + 1);
+    }
+}
+
+inline void assign_to_cluster(double *sums, double *inertia, Vector3 centroid, int cluster_index, double weight,
+                              double sum_l, double sum_a, double sum_b, double sum_squared) {
+    double *cluster_sums = &sums[4*cluster_index];
+    cluster_sums[0] += sum_l;
+    cluster_sums[1] += sum_a;
+    cluster_sums[2] += sum_b;
+    cluster_sums[3] += weight;
+
+    // sum(w*|x - c|^2) = sum(w*|x|^2) - 2*c.sum(w*x) + |c|^2*sum(w)
+    double centroid_dot_sum = centroid.x*sum_l + centroid.y*sum_a + centroid.z*sum_b;
+    double centroid_length_squared = (double)centroid.x*centroid.x + (double)centroid.y*centroid.y +
+                                     (double)centroid.z*centroid.z;
+    *inertia += sum_squared - 2.0*centroid_dot_sum + centroid_length_squared*weight;
+}
+
+inline void filter_kd_node(KD_Filter_Run *run, int node_index, int *candidates, int candidate_count,
+                           double *sums, double *inertia) {
+    KD_Tree *tree = run->tree;
+    KMeans_Cluster *clusters = run->clusters;
+    KD_Node *node = &tree->nodes[node_index];
+
+    if (candidate_count > 1) {
+        // z* is the candidate closest to the middle of the box; any candidate
+        // farther than z* from the box corner furthest in its direction is
+        // farther from every point in the box
+        Vector3 middle = (node->box_min + node->box_max)*0.5f;
+        int best = candidates[0];
+        float best_dist_squared = FLOAT_MAX;
+        for (int c = 0; c < candidate_count; c++) {
+            Vector3 centroid = clusters[candidates[c]].centroid;
+            float d = cielab_distance_squared(middle.x, middle.y, middle.z, centroid.x, centroid.y, centroid.z);
+            if (d < best_dist_squared) {
+                best_dist_squared = d;
+                best = candidates[c];
+            }
+        }
+
+        Vector3 z = clusters[best].centroid;
+        int *kept = candidates + run->cluster_count;
+        int kept_count = 0;
+        for (int c = 0; c < candidate_count; c++) {
+            int j = candidates[c];
+            bool keep = (j == best);
+            if (!keep) {
+                Vector3 centroid = clusters[j].centroid;
+                Vector3 corner = V3((centroid.x > z.x) ? node->box_max.x : node->box_min.x,
+                                    (centroid.y > z.y) ? node->box_max.y : node->box_min.y,
+                                    (centroid.z > z.z) ? node->box_max.z : node->box_min.z);
+                float best_d = cielab_distance_squared(corner.x, corner.y, corner.z, z.x, z.y, z.z);
+                float d = cielab_distance_squared(corner.x, corner.y, corner.z, centroid.x, centroid.y, centroid.z);
+                keep = !bound_prunes(best_d, d);
+            }
+
+            if (keep) kept[kept_count++] = j;
+        }
+
+        candidates = kept;
+        candidate_count = kept_count;
+    }
+
+    if (candidate_count == 1) {
+        int j = candidates[0];
+        assign_to_cluster(sums, inertia, clusters[j].centroid, j, node->weight,
+                          node->sum_l, node->sum_a, node->sum_b, node->sum_squared);
+    } else if (!node->children[0]) {
+        for (int i = node->first; i < node->first + node->count; i++) {
+            float l = tree->l[i];
+            float a = tree->a[i];
+            float b = tree->b[i];
+
+            // Candidates stay in index order, so ties resolve like a full
+            // search
+            float closest_dist_squared = FLOAT_MAX;
+            int closest_cluster_index = candidates[0];
+            for (int c = 0; c < candidate_count; c++) {
+                Vector3 centroid = clusters[candidates[c]].centroid;
+                float d = cielab_distance_squared(l, a, b, centroid.x, centroid.y, centroid.z);
+                if (d < closest_dist_squared) {
+                    closest_dist_squared = d;
+                    closest_cluster_index = candidates[c];
+                }
+            }
+
+            double weight = tree->weights[i];
+            double *cluster_sums = &sums[4*closest_cluster_index];
+            cluster_sums[0] += weight*l;
+            cluster_sums[1] += weight*a;
+            cluster_sums[2] += weight*b;
+            cluster_sums[3] += weight;
+            *inertia += weight*closest_dist_squared;
+        }
+    } else {
+        filter_kd_node(run, node->children[0], candidates, candidate_count, sums, inertia);
+        filter_kd_node(run, node->children[1], candidates, candidate_count, sums, inertia);
+    }
+}
+
+inline void filter_kd_task(void *data, int task_index) {
+    KD_Filter_Run *run = (KD_Filter_Run *)data;
+    int cluster_count = run->cluster_count;
+
+    double *sums = &run->task_sums[4*cluster_count*task_index];
+    for (int j = 0; j < 4*cluster_count; j++) {
+        sums[j] = 0.0;
+    }
+
+    int *candidates = &run->task_candidates[cluster_count*(run->tree->depth + 2)*task_index];
+    for (int j = 0; j < cluster_count; j++) {
+        candidates[j] = j;
+    }
+
+    run->task_inertias[task_index] = 0.0;
+    filter_kd_node(run, run->task_nodes[task_index], candidates, cluster_count, sums,
+                   &run->task_inertias[task_index]);
+}
+
+// Replaces the cluster sums with those of one filtering pass and returns the
+// pass's inertia
+inline double filter_kd_tree(KD_Filter_Run *run, Thread_Pool *pool) {
+    run_parallel(pool, run->task_count, filter_kd_task, run);
+
+    double result = 0.0;
+    for (int j = 0; j < run->cluster_count; j++) {
+        double sum_l = 0.0;
+        double sum_a = 0.0;
+        double sum_b = 0.0;
+        double weight = 0.0;
+        for (int t = 0; t < run->task_count; t++) {
+            double *sums = &run->task_sums[4*(run->cluster_count*t + j)];
+            sum_l += sums[0];
+            sum_a += sums[1];
+            sum_b += sums[2];
+            weight += sums[3];
+        }
+
+        run->clusters[j].observation_sum = V3((float)sum_l, (float)sum_a, (float)sum_b);
+        run->clusters[j].observation_weight = (float)weight;
+    }
+    for (int t = 0; t < run->task_count; t++) {
+        result += run->task_inertias[t];
+    }
+
+    return maximum(0.0, result);
+}
+
+inline KMeans_Result cluster_observations_kdtree(KMeans_Cluster *clusters, int cluster_count,
+                                                 Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                 Palettize_Config *config, Thread_Pool *pool) {
+    KMeans_Result result = {};
+
+    KMeans_Run run;
+    begin_kmeans_run(&run, clusters, cluster_count, observations, prev_cluster_indices);
+    run.label_observations = get_label_observations_kernel(query_simd_level());
+    allocate_centroid_block(&run.centroids, cluster_count);
+    for (int i = 0; i < observations.count; i++) {
+        prev_cluster_indices[i] = 0;
+    }
+
+    KD_Tree tree;
+    build_kd_tree(&tree, observations);
+
+    KD_Filter_Run filter = {};
+    filter.tree = &tree;
+    filter.clusters = clusters;
+    filter.cluster_count = cluster_count;
+    collect_kd_task_nodes(&filter, 0, 0);
+    filter.task_nodes = (int *)malloc(sizeof(int)*filter.task_count);
+    filter.task_count = 0;
+    collect_kd_task_nodes(&filter, 0, 0);
+    filter.task_sums = (double *)malloc(sizeof(double)*4*cluster_count*filter.task_count);
+    filter.task_inertias = (double *)malloc(sizeof(double)*filter.task_count);
+    filter.task_candidates = (int *)malloc(sizeof(int)*cluster_count*(tree.depth + 2)*filter.task_count);
+
+    for (run.iteration = 0;; run.iteration++) {
+        result.inertia = filter_kd_tree(&filter, pool);
+        result.iteration_count = run.iteration + 1;
+        if (result.iteration_count >= config->max_iterations) break;
+
+        // Reseeding picks from candidates that only a full labelling pass
+        // collects, so one is run in the rare pass that leaves a cluster empty
+        bool any_empty = false;
+        for (int j = 0; j < cluster_count; j++) {
+            any_empty = any_empty || (clusters[j].observation_weight <= 0.0f);
+        }
+        if (any_empty) {
+            run.incremental = false;
+            pack_centroid_block(&run.centroids, clusters, cluster_count);
+            run_parallel(pool, run.chunk_count, lloyd_assignment_task, &run);
+            merge_partials(&run);
+        }
+
+        if (update_centroids(&run, config->tolerance)) {
+            result.converged = !run.oscillating;
+
+            // The cluster weights and inertia should describe the centroids
+            // that are returned
+            if (run.max_shift > 0.0f) result.inertia = filter_kd_tree(&filter, pool);
+            break;
+        }
+    }
+    result.has_inertia = true;
+
+    free(filter.task_candidates);
+    free(filter.task_inertias);
+    free(filter.task_sums);
+    free(filter.task_nodes);
+    free_kd_tree(&tree);
+    free_centroid_block(&run.centroids);
+    end_kmeans_run(&run);
+
+    return result;
+}
+
+// Mini-batch k-means (Sculley, "Web-Scale K-Means Clustering"). Each
+// iteration labels a batch of observations drawn in proportion to their
+// weight and pulls every labelled centroid towards its observations with a
+// per-centroid learning rate of 1 / (observations seen so far). It stops once
+// the centroids have moved no more than the tolerance (in total, in CIELAB
+// units) for MINIBATCH_PATIENCE batches in a row, or after
+// config->max_iterations batches. Batches always move the centroids a little,
+// so a tolerance of zero falls back to MINIBATCH_TOLERANCE.
+#define MINIBATCH_TOLERANCE 0.05f
+#define MINIBATCH_PATIENCE 3
+
+inline KMeans_Result cluster_observations_minibatch(KMeans_Cluster *clusters, int cluster_count,
+                                                    Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                    Palettize_Config *config, Random_Series *entropy,
+                                                    Thread_Pool *pool) {
+    KMeans_Result result = {};
+
+    int batch_size = maximum(1, config->batch_size);
+    float tolerance = (config->tolerance > 0.0f) ? config->tolerance : MINIBATCH_TOLERANCE;
+
+    // Observations are drawn by binary searching a running sum of their
+    // weights, kept in double so it stays exact for very large images
+    double *cumulative_weights = (double *)malloc(sizeof(double)*observations.count);
+    double total_weight = 0.0;
+    for (int i = 0; i < observations.count; i++) {
+        total_weight += observations.weights[i];
+        cumulative_weights[i] = total_weight;
+    }
+
+    Observation_Buffer batch = {};
+    batch.count = batch_size;
+    batch.capacity = (batch_size + (SIMD_MAX_LANES - 1)) & ~(SIMD_MAX_LANES - 1);
+    float *batch_memory = (float *)allocate_aligned(3*sizeof(float)*batch.capacity, 64);
+    batch.l = batch_memory;
+    batch.a = batch_memory + batch.capacity;
+    batch.b = batch_memory + 2*batch.capacity;
+    for (int i = 0; i < batch.capacity; i++) {
+        batch.l[i] = batch.a[i] = batch.b[i] = 0.0f;
+    }
+
+    u32 *batch_labels = (u32 *)malloc(sizeof(u32)*batch_size);
+    float *centroid_counts = (float *)malloc(sizeof(float)*cluster_count);
+    Vector3 *prev_centroids = (Vector3 *)malloc(sizeof(Vector3)*cluster_count);
+    for (int j = 0; j < cluster_count; j++) {
+        centroid_counts[j] = 0.0f;
+    }
+
+    Label_Observations_Kernel *label_observations = get_label_observations_kernel(query_simd_level());
+    Centroid_Block centroids;
+    allocate_centroid_block(&centroids, cluster_count);
+
+    int converged_batches = 0;
+    for (int iteration = 0; iteration < config->max_iterations; iteration++) {
+        result.iteration_count = iteration + 1;
+
+        for (int i = 0; i < batch_size; i++) {
+            double target = random_unilateral(entropy)*total_weight;
+
+            int lo = 0;
+            int hi = observations.count - 1;
+            while (lo < hi) {
+                int mid = lo + (hi - lo)/2;
+                if (cumulative_weights[mid] <= target) lo = mid + 1; else hi = mid;
+            }
+
+            batch.l[i] = observations.l[lo];
+            batch.a[i] = observations.a[lo];
+            batch.b[i] = observations.b[lo];
+        }
+
+        // The whole batch is labelled against the centroids as they stood at
+        // the start of the batch
+        pack_centroid_block(&centroids, clusters, cluster_count);
+        for (int first = 0; first < batch_size; first += 256) {
+            int count = minimum(256, batch_size - first);
+            label_observations(batch, first, count, centroids, batch_labels + first);
+        }
+
+        for (int j = 0; j < cluster_count; j++) {
+            prev_centroids[j] = clusters[j].centroid;
+        }
+
+        for (int i = 0; i < batch_size; i++) {
+            u32 cluster_index = batch_labels[i];
+            KMeans_Cluster *cluster = &clusters[cluster_index];
+
+            centroid_counts[cluster_index] += 1.0f;
+            float learning_rate = 1.0f / centroid_counts[cluster_index];
+            cluster->centroid = cluster->centroid*(1.0f - learning_rate) + get_observation(batch, i)*learning_rate;
+        }
+
+        float total_shift = 0.0f;
+        for (int j = 0; j < cluster_count; j++) {
+            Vector3 c = clusters[j].centroid;
+            total_shift += sqrt(cielab_distance_squared(c.x, c.y, c.z,
+                                                        prev_centroids[j].x, prev_centroids[j].y, prev_centroids[j].z));
+        }
+
+        if (total_shift <= tolerance) {
+            if (++converged_batches >= MINIBATCH_PATIENCE) {
+                result.converged = true;
+                break;
+            }
+        } else {
+            converged_batches = 0;
+        }
+    }
+
+    // One full labelling pass gives every observation a label and every
+    // cluster its weight without moving the centroids
+    KMeans_Run run;
+    begin_kmeans_run(&run, clusters, cluster_count, observations, prev_cluster_indices);
+    run.label_observations = label_observations;
+    run.centroids = centroids;
+    run.iteration = 0;
+
+    pack_centroid_block(&run.centroids, clusters, cluster_count);
+    run_parallel(pool, run.chunk_count, lloyd_assignment_task, &run);
+    merge_partials(&run);
+    end_kmeans_run(&run);
+
+    free_centroid_block(&centroids);
+    free(prev_centroids);
+    free(centroid_counts);
+    free(batch_labels);
+    free_aligned(batch_memory);
+    free(cumulative_weights);
+
+    return result;
+}
+
+// k-means++ seeding (Arthur and Vassilvitskii) picks each new centroid with
+// probability proportional to its weighted squared distance from the nearest
+// centroid picked so far. The greedy variant draws several candidates per
+// step and keeps the one that lowers the total weighted distance the most.
+struct Seeding_Run {
+    Observation_Buffer observations;
+    Nearest_Distances_Kernel *nearest_distances;
+
+    // Squared distance from each observation to its nearest seed so far,
+    // padded like the planes
+    float *nearest_dists;
+
+    Vector3 *candidates;
+    int candidate_count;
+    bool update_nearest;
+
+    float *candidate_dists;
+    double *chunk_potentials;
+};
+
+inline void seeding_task(void *data, int chunk_index) {
+    Seeding_Run *run = (Seeding_Run *)data;
+
+    int first = chunk_index*KMEANS_CHUNK_SIZE;
+    int count = minimum(KMEANS_CHUNK_SIZE, run->observations.count - first);
+    float *nearest_dists = run->nearest_dists + first;
+
+    if (run->update_nearest) {
+        run->nearest_distances(run->observations, first, count, run->candidates[0], nearest_dists, nearest_dists);
+    } else {
+        float *candidate_dists = run->candidate_dists + first;
+        for (int c = 0; c < run->candidate_count; c++) {
+            run->nearest_distances(run->observations, first, count, run->candidates[c], nearest_dists,
+                                   candidate_dists);
+
+            double potential = 0.0;
+            for (int i = 0; i < count; i++) {
+                potential += (double)(run->observations.weights[first + i]*candidate_dists[i]);
+            }
+            run->chunk_potentials[chunk_index*run->candidate_count + c] = potential;
+        }
+    }
+}
+
+inline void seed_clusters_kmeans_plus_plus(KMeans_Cluster *clusters, int cluster_count,
+                                           Observation_Buffer observations, int candidate_count,
+                                           Random_Series *entropy, Thread_Pool *pool) {
+    int chunk_count = (observations.count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+
+    Seeding_Run run = {};
+    run.observations = observations;
+    run.nearest_distances = get_nearest_distances_kernel(query_simd_level());
+    run.nearest_dists = (float *)allocate_aligned(sizeof(float)*observations.capacity, 64);
+    run.candidates = (Vector3 *)malloc(sizeof(Vector3)*candidate_count);
+    run.candidate_dists = (float *)allocate_aligned(sizeof(float)*observations.capacity, 64);
+    run.chunk_potentials = (double *)malloc(sizeof(double)*chunk_count*candidate_count);
+    for (int i = 0; i < observations.capacity; i++) {
+        run.nearest_dists[i] = FLOAT_MAX;
+    }
+
+    // Candidates are drawn by binary searching a running sum of weighted
+    // distances; before the first seed every observation just counts its weight
+    double *cumulative_potentials = (double *)malloc(sizeof(double)*observations.count);
+    double total_potential = 0.0;
+    for (int i = 0; i < observations.count; i++) {
+        total_potential += observations.weights[i];
+        cumulative_potentials[i] = total_potential;
+    }
+
+    for (int j = 0; j < cluster_count; j++) {
+        run.candidate_count = (j == 0) ? 1 : candidate_count;
+        for (int c = 0; c < run.candidate_count; c++) {
+            double target = random_unilateral(entropy)*total_potential;
+
+            int lo = 0;
+            int hi = observations.count - 1;
+            while (lo < hi) {
+                int mid = lo + (hi - lo)/2;
+                if (cumulative_potentials[mid] <= target) lo = mid + 1; else hi = mid;
+            }
+
+            run.candidates[c] = get_observation(observations, lo);
+        }
+
+        int best_candidate = 0;
+        if (run.candidate_count > 1) {
+            run.update_nearest = false;
+            run_parallel(pool, chunk_count, seeding_task, &run);
+
+            double best_potential = DBL_MAX;
+            for (int c = 0; c < run.candidate_count; c++) {
+                double potential = 0.0;
+                for (int chunk_index = 0; chunk_index < chunk_count; chunk_index++) {
+                    potential += run.chunk_potentials[chunk_index*run.candidate_count + c];
+                }
+
+                if (potential < best_potential) {
+                    best_potential = potential;
+                    best_candidate = c;
+                }
+            }
+        }
+
+        clusters[j].centroid = run.candidates[best_candidate];
+        clusters[j].observation_sum = V3i(0, 0, 0);
+        clusters[j].observation_weight = 0.0f;
+
+        run.candidates[0] = run.candidates[best_candidate];
+        run.update_nearest = true;
+        run_parallel(pool, chunk_count, seeding_task, &run);
+
+        total_potential = 0.0;
+        for (int i = 0; i < observations.count; i++) {
+            total_potential += (double)(observations.weights[i]*run.nearest_dists[i]);
+            cumulative_potentials[i] = total_potential;
+        }
+
+        // Once every observation coincides with a seed there is nothing left
+        // to weight by, so any remaining seeds are drawn by weight alone
+        if (total_potential <= 0.0) {
+            for (int i = 0; i < observations.count; i++) {
+                total_potential += observations.weights[i];
+                cumulative_potentials[i] = total_potential;
+            }
+        }
+    }
+
+    free(cumulative_potentials);
+    free(run.chunk_potentials);
+    free_aligned(run.candidate_dists);
+    free(run.candidates);
+    free_aligned(run.nearest_dists);
+}
+
+inline void seed_clusters(KMeans_Cluster *clusters, int cluster_count, Bitmap_Sampler sampler,
+                          Observation_Buffer observations, Palettize_Config *config,
+                          Random_Series *entropy, Thread_Pool *pool) {
+    switch (config->seed_method) {
+        case SEED_METHOD_RANDOM: {
+            for (int i = 0; i < cluster_count; i++) {
+                KMeans_Cluster *cluster = &clusters[i];
+
+                cluster->observation_sum = V3i(0, 0, 0);
+                cluster->observation_weight = 0.0f;
+
+                // Naive cluster seeding, redrawing pixels that were left out
+                // for being too transparent a few times before giving up
+                u32 sample = 0;
+                for (int attempt = 0; attempt < 64; attempt++) {
+                    u32 sample_x = random_u32_between(entropy, 0, (u32)(sampler.columns - 1));
+                    u32 sample_y = random_u32_between(entropy, 0, (u32)(sampler.rows - 1));
+                    sample = get_bitmap_sample(&sampler, (int)sample_x, (int)sample_y);
+                    if ((int)(sample >> 24) >= config->alpha_threshold) break;
+                }
+
+                cluster->centroid = unpack_rgba_to_cielab(sample);
+            }
+        } break;
+
+        case SEED_METHOD_KMEANS_PLUS_PLUS: {
+            seed_clusters_kmeans_plus_plus(clusters, cluster_count, observations, 1, entropy, pool);
+        } break;
+
+        case SEED_METHOD_GREEDY_KMEANS_PLUS_PLUS: {
+            // 2 + ln(k) candidates per step, as suggested by Arthur and
+            // Vassilvitskii and used by scikit-learn
+            int candidate_count = config->seed_candidates;
+            if (candidate_count <= 0) {
+                candidate_count = 2 + (int)log((double)cluster_count);
+            }
+
+            seed_clusters_kmeans_plus_plus(clusters, cluster_count, observations, candidate_count, entropy, pool);
+        } break;
+
+        case SEED_METHOD_WU: {
+            // Wu's boxes are usually close enough to a local optimum that
+            // Lloyd only needs a few passes from them
+            quantize_observations_wu(clusters, cluster_count, observations);
+        } break;
+
+        case SEED_METHOD_MEDIAN_CUT: {
+            // Deterministic like Wu's boxes, but cut at medians rather than
+            // where they minimize variance
+            seed_clusters_median_cut(clusters, cluster_count, observations);
+        } break;
+
+        case SEED_METHOD_PALETTE: {
+            // Usually a previous palette of the same image, so clustering
+            // starts next to where it will end up
+            assert(config->initial_centroid_count >= cluster_count);
+            for (int i = 0; i < cluster_count; i++) {
+                KMeans_Cluster *cluster = &clusters[i];
+
+                cluster->centroid = config->initial_centroids[i];
+                cluster->observation_sum = V3i(0, 0, 0);
+                cluster->observation_weight = 0.0f;
+            }
+        } break;
+
+        Invalid_Default_Case;
+    }
+}
+
+inline KMeans_Result cluster_observations(KMeans_Cluster *clusters, int cluster_count,
+                                         Observation_Buffer observations, u8 *prev_cluster_indices,
+                                         Palettize_Config *config, Random_Series *entropy, Thread_Pool *pool) {
+    KMeans_Result result = {};
+
+    switch (config->method) {
+        case CLUSTER_METHOD_LLOYD: {
+            result = cluster_observations_lloyd(clusters, cluster_count, observations, prev_cluster_indices,
+                                                config, pool);
+        } break;
+
+        case CLUSTER_METHOD_HAMERLY: {
+            result = cluster_observations_bounded(clusters, cluster_count, observations, prev_cluster_indices,
+                                                  CLUSTER_METHOD_HAMERLY, config, pool);
+        } break;
+
+        case CLUSTER_METHOD_ELKAN: {
+            result = cluster_observations_bounded(clusters, cluster_count, observations, prev_cluster_indices,
+                                                  CLUSTER_METHOD_ELKAN, config, pool);
+        } break;
+
+        case CLUSTER_METHOD_YINYANG: {
+            result = cluster_observations_bounded(clusters, cluster_count, observations, prev_cluster_indices,
+                                                  CLUSTER_METHOD_YINYANG, config, pool);
+        } break;
+
+        case CLUSTER_METHOD_KDTREE: {
+            result = cluster_observations_kdtree(clusters, cluster_count, observations, prev_cluster_indices,
+                                                 config, pool);
+        } break;
+
+        case CLUSTER_METHOD_MINIBATCH: {
+            result = cluster_observations_minibatch(clusters, cluster_count, observations, prev_cluster_indices,
+                                                    config, entropy, pool);
+        } break;
+
+        case CLUSTER_METHOD_WU: {
+            // The boxes are final, so there's nothing to iterate
+            quantize_observations_wu(clusters, cluster_count, observations);
+            result.converged = true;
+        } break;
+
+        Invalid_Default_Case;
+    }
+
+    return result;
+}
+
+// Inertia is the weighted sum of squared distances from every observation to
+// its nearest centroid. It's measured with a fresh labelling pass so it
+// matches the palette that is returned, whichever way clustering stopped.
+//
+// The same pass can also reweigh the clusters by the observations nearest to
+// them, for clusters that were fitted to a sample of the observations.
+struct Inertia_Run {
+    Observation_Buffer observations;
+    Label_Observations_Kernel *label_observations;
+    Centroid_Block centroids;
+    double *chunk_inertias;
+
+    // Per chunk and cluster, or null
+    double *chunk_weights;
+};
+
+inline void inertia_task(void *data, int chunk_index) {
+    Inertia_Run *run = (Inertia_Run *)data;
+
+    int chunk_first = chunk_index*KMEANS_CHUNK_SIZE;
+    int chunk_end = minimum(chunk_first + KMEANS_CHUNK_SIZE, run->observations.count);
+
+    const int block_size = 256;
+    u32 labels[block_size];
+
+    double *weights = 0;
+    if (run->chunk_weights) {
+        weights = run->chunk_weights + chunk_index*run->centroids.count;
+        memset(weights, 0, sizeof(double)*run->centroids.count);
+    }
+
+    double inertia = 0.0;
+    for (int first = chunk_first; first < chunk_end; first += block_size) {
+        int count = minimum(block_size, chunk_end - first);
+        run->label_observations(run->observations, first, count, run->centroids, labels);
+
+        for (int i = 0; i < count; i++) {
+            u32 j = labels[i];
+            float d = cielab_distance_squared(run->observations.l[first + i], run->observations.a[first + i],
+                                              run->observations.b[first + i],
+                                              run->centroids.l[j], run->centroids.a[j], run->centroids.b[j]);
+            inertia += (double)(run->observations.weights[first + i]*d);
+            if (weights) weights[j] += run->observations.weights[first + i];
+        }
+    }
+
+    run->chunk_inertias[chunk_index] = inertia;
+}
+
+inline double measure_inertia(KMeans_Cluster *clusters, int cluster_count, Observation_Buffer observations,
+                              Thread_Pool *pool, bool reweigh_clusters = false) {
+    int chunk_count = (observations.count + (KMEANS_CHUNK_SIZE - 1)) / KMEANS_CHUNK_SIZE;
+
+    Inertia_Run run;
+    run.observations = observations;
+    run.label_observations = get_label_observations_kernel(query_simd_level());
+    allocate_centroid_block(&run.centroids, cluster_count);
+    pack_centroid_block(&run.centroids, clusters, cluster_count);
+    run.chunk_inertias = (double *)malloc(sizeof(double)*chunk_count);
+    run.chunk_weights = reweigh_clusters ? (double *)malloc(sizeof(double)*chunk_count*cluster_count) : 0;
+
+    run_parallel(pool, chunk_count, inertia_task, &run);
+
+    double result = 0.0;
+    for (int i = 0; i < chunk_count; i++) {
+        result += run.chunk_inertias[i];
+    }
+
+    if (reweigh_clusters) {
+        for (int j = 0; j < cluster_count; j++) {
+            double weight = 0.0;
+            for (int i = 0; i < chunk_count; i++) {
+                weight += run.chunk_weights[i*cluster_count + j];
+            }
+
+            clusters[j].observation_weight = (float)weight;
+            clusters[j].observation_sum = clusters[j].centroid*(float)weight;
+        }
+        free(run.chunk_weights);
+    }
+
+    free(run.chunk_inertias);
+    free_centroid_block(&run.centroids);
+
+    return result;
+}
+
+// Restarts seed and cluster independently from their own random series and
+// the one with the lowest inertia wins (the earliest on a tie). With more
+// than one restart and more than one thread, whole restarts run side by side
+// on the pool; otherwise each restart spreads its passes across the pool.
+// Either way every restart computes exactly what it would on its own.
+struct KMeans_Restart {
+    KMeans_Cluster *clusters;
+    u8 *cluster_indices;
+    Random_Series entropy;
+    KMeans_Result result;
+};
+
+struct Restart_Batch {
+    KMeans_Restart *restarts;
+    int cluster_count;
+    Bitmap_Sampler sampler;
+    Observation_Buffer observations;
+    Palettize_Config *config;
+    Thread_Pool *pool;
+};
+
+inline void restart_task(void *data, int restart_index) {
+    Restart_Batch *batch = (Restart_Batch *)data;
+    KMeans_Restart *restart = &batch->restarts[restart_index];
+
+    // Wu's quantizer doesn't start from seeds
+    if (batch->config->method != CLUSTER_METHOD_WU) {
+        seed_clusters(restart->clusters, batch->cluster_count, batch->sampler, batch->observations, batch->config,
+                      &restart->entropy, batch->pool);
+    }
+    restart->result = cluster_observations(restart->clusters, batch->cluster_count, batch->observations,
+                                           restart->cluster_indices, batch->config, &restart->entropy, batch->pool);
+    if (!restart->result.has_inertia) {
+        restart->result.inertia = measure_inertia(restart->clusters, batch->cluster_count, batch->observations,
+                                                  batch->pool);
+    }
+}
+
+// Leaves the winning restart in clusters and prev_cluster_indices and, if
+// restart_inertias isn't null, the inertia of every restart in it
+inline KMeans_Result cluster_observations_with_restarts(KMeans_Cluster *clusters, int cluster_count, Bitmap_Sampler sampler,
+                                                        Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                        Palettize_Config *config, Thread_Pool *pool,
+                                                        double *restart_inertias) {
+    int restart_count = maximum(1, config->restart_count);
+
+    // Only Lloyd has fixed-point kernels; the planes are shared by every
+    // restart
+    bool quantized = false;
+    if (config->fixed_point && config->method == CLUSTER_METHOD_LLOYD && !observations.fixed_l) {
+        quantize_observations(&observations);
+        quantized = true;
+    }
+
+    KMeans_Restart *restarts = (KMeans_Restart *)malloc(sizeof(KMeans_Restart)*restart_count);
+    for (int r = 0; r < restart_count; r++) {
+        KMeans_Restart *restart = &restarts[r];
+
+        // The first restart uses the seed as given so a single restart
+        // matches a plain run
+        u32 restart_seed = config->seed + (u32)r*0x9E3779B9u;
+        if (r > 0 && restart_seed == 0) restart_seed = 0x9E3779B9u;
+
+        restart->clusters = (r == 0) ? clusters : (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count);
+        restart->cluster_indices = (r == 0) ? prev_cluster_indices : (u8 *)malloc(sizeof(u8)*observations.count);
+        restart->entropy = seed_series(restart_seed);
+    }
+
+    Restart_Batch batch;
+    batch.restarts = restarts;
+    batch.cluster_count = cluster_count;
+    batch.sampler = sampler;
+    batch.observations = observations;
+    batch.config = config;
+
+    if (restart_count > 1 && pool && pool->thread_count > 1) {
+        batch.pool = 0;
+        run_parallel(pool, restart_count, restart_task, &batch);
+    } else {
+        batch.pool = pool;
+        for (int r = 0; r < restart_count; r++) {
+            restart_task(&batch, r);
+        }
+    }
+
+    int best_restart = 0;
+    for (int r = 0; r < restart_count; r++) {
+        if (restart_inertias) restart_inertias[r] = restarts[r].result.inertia;
+        if (restarts[r].result.inertia < restarts[best_restart].result.inertia) best_restart = r;
+    }
+
+    KMeans_Result result = restarts[best_restart].result;
+    result.restart_index = best_restart;
+    if (best_restart > 0) {
+        memcpy(clusters, restarts[best_restart].clusters, sizeof(KMeans_Cluster)*cluster_count);
+        memcpy(prev_cluster_indices, restarts[best_restart].cluster_indices, sizeof(u8)*observations.count);
+    }
+
+    for (int r = 1; r < restart_count; r++) {
+        free(restarts[r].cluster_indices);
+        free(restarts[r].clusters);
+    }
+    free(restarts);
+
+    if (quantized) free_fixed_observations(&observations);
+
+    return result;
+}
+
+inline void sort_clusters_by_centroid(KMeans_Cluster *clusters, int cluster_count, Sort_Type sort_type) {
+    Vector3 focal_color = V3i(0, 0, 0);
+    switch (sort_type) {
+        case SORT_TYPE_WEIGHT:
+            // Needs no focal color
+            break;
+
+        case SORT_TYPE_RED:
+            focal_color = {
+                53.23288178584245f,
+                80.10930952982204f,
+                67.22006831026425f
+            };
+            break;
+
+        case SORT_TYPE_GREEN:
+            focal_color = {
+                 87.73703347354422f,
+                -86.18463649762525f,
+                 83.18116474777854f
+            };
+            break;
+
+        case SORT_TYPE_BLUE:
+            focal_color = {
+                 32.302586667249486f,
+                 79.19666178930935f,
+                -107.86368104495168f
+            };
+            break;
+    }
+
+    for (int i = 0; i < cluster_count; i++) {
+        bool swapped = false;
+
+        for (int j = 0; j < (cluster_count - 1); j++) {
+            KMeans_Cluster *cluster_a = clusters + j;
+            KMeans_Cluster *cluster_b = clusters + j + 1;
+
+            if (sort_type == SORT_TYPE_WEIGHT) {
+                if (cluster_b->observation_weight > cluster_a->observation_weight) {
+                    KMeans_Cluster swap = *cluster_a;
+                    *cluster_a = *cluster_b;
+                    *cluster_b = swap;
+
+                    swapped = true;
+                }
+            } else if (sort_type == SORT_TYPE_RED || sort_type == SORT_TYPE_GREEN || sort_type == SORT_TYPE_BLUE) {
+                float dist_squared_to_color_a = length_squared(cluster_a->centroid - focal_color);
+                float dist_squared_to_color_b = length_squared(cluster_b->centroid - focal_color);
+                if (dist_squared_to_color_b < dist_squared_to_color_a) {
+                    KMeans_Cluster swap = *cluster_a;
+                    *cluster_a = *cluster_b;
+                    *cluster_b = swap;
+
+                    swapped = true;
+                }
+            }
+        }
+
+        if (!swapped) break;
+    }
+}
+
+#endif
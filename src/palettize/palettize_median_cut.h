@@ -0,0 +1,189 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_MEDIAN_CUT_H
+#define PALETTIZE_MEDIAN_CUT_H
+
+// Heckbert's median cut ("Color Image Quantization for Frame Buffer
+// Display", SIGGRAPH 1982) over the unique colors. Starting from a box around
+// every observation, the box with the longest side is cut across that side
+// at its weighted median until there are cluster_count boxes. Heckbert's
+// choice of the longest side rather than the heaviest box keeps small but
+// distant groups of colors from being swallowed by a large one. The median is
+// found on a MEDIAN_CUT_BINS histogram of the side rather than by sorting, so
+// each cut is two passes over the box. Nothing is random, so the clusters
+// only depend on the observations.
+#define MEDIAN_CUT_BINS 256
+
+struct Median_Cut_Box {
+    // The box's observations are order[first] to order[first + count - 1]
+    int first;
+    int count;
+    double weight;
+    float mins[3];
+    float maxs[3];
+};
+
+inline void measure_median_cut_box(Median_Cut_Box *box, int *order, Observation_Buffer observations) {
+    float *planes[3] = {observations.l, observations.a, observations.b};
+
+    box->weight = 0.0;
+    for (int axis = 0; axis < 3; axis++) {
+        box->mins[axis] = FLOAT_MAX;
+        box->maxs[axis] = -FLOAT_MAX;
+    }
+    for (int i = box->first; i < box->first + box->count; i++) {
+        int o = order[i];
+        box->weight += (double)observations.weights[o];
+        for (int axis = 0; axis < 3; axis++) {
+            box->mins[axis] = minimum(box->mins[axis], planes[axis][o]);
+            box->maxs[axis] = maximum(box->maxs[axis], planes[axis][o]);
+        }
+    }
+}
+
+inline int get_median_cut_axis(Median_Cut_Box *box) {
+    int result = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (box->maxs[axis] - box->mins[axis] > box->maxs[result] - box->mins[result]) result = axis;
+    }
+
+    return result;
+}
+
+inline double get_median_cut_priority(Median_Cut_Box *box) {
+    int axis = get_median_cut_axis(box);
+    double result = (box->weight > 0.0) ? (double)(box->maxs[axis] - box->mins[axis]) : 0.0;
+
+    return result;
+}
+
+// Moves the observations below the weighted median of the box's longest side
+// to the front of its range and the rest into new_box. The lowest bin always
+// goes first and the highest always goes second, so neither half is empty.
+inline void cut_median_cut_box(Median_Cut_Box *box, Median_Cut_Box *new_box, int *order,
+                               Observation_Buffer observations) {
+    float *planes[3] = {observations.l, observations.a, observations.b};
+    int axis = get_median_cut_axis(box);
+    float *plane = planes[axis];
+    float min = box->mins[axis];
+    float scale = (float)MEDIAN_CUT_BINS / (box->maxs[axis] - min);
+
+    double bin_weights[MEDIAN_CUT_BINS] = {};
+    for (int i = box->first; i < box->first + box->count; i++) {
+        int o = order[i];
+        int bin = clampi(0, (int)((plane[o] - min)*scale), MEDIAN_CUT_BINS - 1);
+        bin_weights[bin] += (double)observations.weights[o];
+    }
+
+    int cut_bin = 0;
+    double below = bin_weights[0];
+    while (cut_bin < MEDIAN_CUT_BINS - 2 && below < 0.5*box->weight) {
+        cut_bin++;
+        below += bin_weights[cut_bin];
+    }
+
+    int split = box->first;
+    for (int i = box->first; i < box->first + box->count; i++) {
+        int o = order[i];
+        int bin = clampi(0, (int)((plane[o] - min)*scale), MEDIAN_CUT_BINS - 1);
+        if (bin <= cut_bin) {
+            order[i] = order[split];
+            order[split] = o;
+            split++;
+        }
+    }
+
+    new_box->first = split;
+    new_box->count = box->first + box->count - split;
+    box->count = split - box->first;
+    measure_median_cut_box(box, order, observations);
+    measure_median_cut_box(new_box, order, observations);
+}
+
+// Fills clusters with the means of the boxes. If there are fewer unique
+// colors than clusters, the remaining clusters repeat the heaviest box's mean
+// with no weight, like quantize_observations_wu().
+inline void seed_clusters_median_cut(KMeans_Cluster *clusters, int cluster_count, Observation_Buffer observations) {
+    int *order = (int *)malloc(sizeof(int)*observations.count);
+    for (int i = 0; i < observations.count; i++) order[i] = i;
+
+    Median_Cut_Box *boxes = (Median_Cut_Box *)malloc(sizeof(Median_Cut_Box)*cluster_count);
+    double *priorities = (double *)malloc(sizeof(double)*cluster_count);
+    boxes[0].first = 0;
+    boxes[0].count = observations.count;
+    measure_median_cut_box(&boxes[0], order, observations);
+    priorities[0] = get_median_cut_priority(&boxes[0]);
+
+    int box_count = 1;
+    while (box_count < cluster_count) {
+        int next = 0;
+        for (int i = 1; i < box_count; i++) {
+            if (priorities[i] > priorities[next]) next = i;
+        }
+        if (priorities[next] <= 0.0) break;
+
+        cut_median_cut_box(&boxes[next], &boxes[box_count], order, observations);
+        priorities[next] = get_median_cut_priority(&boxes[next]);
+        priorities[box_count] = get_median_cut_priority(&boxes[box_count]);
+        box_count++;
+    }
+
+    int heaviest = 0;
+    for (int i = 0; i < box_count; i++) {
+        Median_Cut_Box *box = &boxes[i];
+        KMeans_Cluster *cluster = &clusters[i];
+
+        double l = 0.0;
+        double a = 0.0;
+        double b = 0.0;
+        for (int j = box->first; j < box->first + box->count; j++) {
+            int o = order[j];
+            double weight = (double)observations.weights[o];
+            l += weight*(double)observations.l[o];
+            a += weight*(double)observations.a[o];
+            b += weight*(double)observations.b[o];
+        }
+
+        cluster->observation_sum = V3((float)l, (float)a, (float)b);
+        cluster->observation_weight = (float)box->weight;
+        cluster->centroid = (box->weight > 0.0) ? V3((float)(l / box->weight), (float)(a / box->weight),
+                                                     (float)(b / box->weight))
+                                                : V3i(0, 0, 0);
+
+        if (cluster->observation_weight > clusters[heaviest].observation_weight) heaviest = i;
+    }
+    for (int i = box_count; i < cluster_count; i++) {
+        clusters[i].centroid = clusters[heaviest].centroid;
+        clusters[i].observation_sum = V3i(0, 0, 0);
+        clusters[i].observation_weight = 0.0f;
+    }
+
+    free(priorities);
+    free(boxes);
+    free(order);
+}
+
+#endif
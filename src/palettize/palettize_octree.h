@@ -0,0 +1,379 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_OCTREE_H
+#define PALETTIZE_OCTREE_H
+
+// Octree color quantization (Gervautz and Purgathofer, "A Simple Method for
+// Color Quantization: Octree Quantization"). Each pixel walks down from the
+// root one bit of R, G and B per level, and the leaf it lands in sums its
+// CIELAB moments. Nodes come from a fixed pool of OCTREE_MAX_NODES, and
+// whenever the pool runs low the lightest node on the deepest level of
+// internal nodes folds its children into itself. Pixels can be added a row at
+// a time and the tree never grows with the image, so the quantizer doesn't
+// need the unique-color histogram or observation buffer the k-means methods
+// build. With a Row_Reader, the image itself is never held whole either.
+#define OCTREE_DEPTH 8
+#define OCTREE_MAX_NODES 16384
+
+// Recently converted colors, so runs of similar pixels don't each pay for a
+// CIELAB conversion
+#define OCTREE_CACHE_SIZE 4096
+
+struct Octree_Node {
+    int children[8];
+    int child_count;
+    int level;
+    bool leaf;
+
+    // Internal nodes link to the next internal node on their level, and free
+    // nodes to the next free node
+    int next;
+
+    // The weight covers the whole subtree; the moments are only summed in
+    // leaves
+    double weight;
+    double l;
+    double a;
+    double b;
+    double squares;
+};
+
+struct Octree {
+    Octree_Node *nodes;
+    int node_count;
+    int unused_node;
+    int free_node;
+    int leaf_count;
+    int reducible[OCTREE_DEPTH];
+
+    u32 cache_colors[OCTREE_CACHE_SIZE];
+    Vector3 cache_cielab[OCTREE_CACHE_SIZE];
+};
+
+inline int allocate_octree_node(Octree *tree, int level) {
+    assert(tree->node_count < OCTREE_MAX_NODES);
+
+    int result;
+    if (tree->free_node >= 0) {
+        result = tree->free_node;
+        tree->free_node = tree->nodes[result].next;
+    } else {
+        result = tree->unused_node++;
+    }
+    tree->node_count++;
+
+    Octree_Node *node = &tree->nodes[result];
+    *node = {};
+    node->level = level;
+    node->leaf = (level == OCTREE_DEPTH);
+    if (node->leaf) {
+        tree->leaf_count++;
+    } else {
+        node->next = tree->reducible[level];
+        tree->reducible[level] = result;
+    }
+
+    return result;
+}
+
+inline void free_octree_node(Octree *tree, int index) {
+    tree->nodes[index].next = tree->free_node;
+    tree->free_node = index;
+    tree->node_count--;
+}
+
+inline void create_octree(Octree *tree) {
+    tree->nodes = (Octree_Node *)malloc(sizeof(Octree_Node)*OCTREE_MAX_NODES);
+    tree->node_count = 0;
+    tree->unused_node = 0;
+    tree->free_node = -1;
+    tree->leaf_count = 0;
+    for (int level = 0; level < OCTREE_DEPTH; level++) {
+        tree->reducible[level] = -1;
+    }
+    for (int i = 0; i < OCTREE_CACHE_SIZE; i++) {
+        tree->cache_colors[i] = 0xFFFFFFFF;
+    }
+
+    allocate_octree_node(tree, 0);
+}
+
+inline void free_octree(Octree *tree) {
+    free(tree->nodes);
+    tree->nodes = 0;
+}
+
+// Unlinks and returns the lightest internal node on the deepest level that
+// has any. Every child of such a node is a leaf, since a deeper internal node
+// would be on a deeper level.
+inline int pop_lightest_reducible_node(Octree *tree) {
+    int level = OCTREE_DEPTH - 1;
+    while (level > 0 && tree->reducible[level] < 0) level--;
+    assert(tree->reducible[level] >= 0);
+
+    int result = -1;
+    int result_prev = -1;
+    for (int prev = -1, index = tree->reducible[level]; index >= 0; prev = index, index = tree->nodes[index].next) {
+        if (result < 0 || tree->nodes[index].weight < tree->nodes[result].weight) {
+            result = index;
+            result_prev = prev;
+        }
+    }
+
+    if (result_prev >= 0) {
+        tree->nodes[result_prev].next = tree->nodes[result].next;
+    } else {
+        tree->reducible[level] = tree->nodes[result].next;
+    }
+
+    return result;
+}
+
+inline void merge_octree_moments(Octree_Node *dest, Octree_Node *source) {
+    dest->l += source->l;
+    dest->a += source->a;
+    dest->b += source->b;
+    dest->squares += source->squares;
+}
+
+// Folds every child of the node into it, turning it into a leaf
+inline void reduce_octree_node(Octree *tree, int index) {
+    Octree_Node *node = &tree->nodes[index];
+    for (int i = 0; i < 8; i++) {
+        int child_index = node->children[i];
+        if (!child_index) continue;
+
+        Octree_Node *child = &tree->nodes[child_index];
+        assert(child->leaf);
+        merge_octree_moments(node, child);
+        free_octree_node(tree, child_index);
+        tree->leaf_count--;
+
+        node->children[i] = 0;
+    }
+
+    node->child_count = 0;
+    node->leaf = true;
+    tree->leaf_count++;
+}
+
+inline void add_octree_pixel(Octree *tree, u32 color, double weight) {
+    color &= 0x00FFFFFF;
+
+    u32 slot = (color*2654435761u) >> 20;
+    if (tree->cache_colors[slot] != color) {
+        tree->cache_colors[slot] = color;
+        tree->cache_cielab[slot] = unpack_rgba_to_cielab(color);
+    }
+    Vector3 cielab = tree->cache_cielab[slot];
+
+    // A new pixel can need a fresh node on every level below the root
+    while (tree->node_count + OCTREE_DEPTH > OCTREE_MAX_NODES) {
+        reduce_octree_node(tree, pop_lightest_reducible_node(tree));
+    }
+
+    u32 r = (color >> 0) & 0xFF;
+    u32 g = (color >> 8) & 0xFF;
+    u32 b = (color >> 16) & 0xFF;
+
+    int index = 0;
+    for (;;) {
+        Octree_Node *node = &tree->nodes[index];
+        node->weight += weight;
+        if (node->leaf) {
+            node->l += weight*cielab.x;
+            node->a += weight*cielab.y;
+            node->b += weight*cielab.z;
+            node->squares += weight*((double)cielab.x*cielab.x + (double)cielab.y*cielab.y +
+                                     (double)cielab.z*cielab.z);
+            break;
+        }
+
+        int shift = (OCTREE_DEPTH - 1) - node->level;
+        int child = (((r >> shift) & 1) << 2) | (((g >> shift) & 1) << 1) | ((b >> shift) & 1);
+        if (!node->children[child]) {
+            int child_index = allocate_octree_node(tree, node->level + 1);
+            node = &tree->nodes[index];
+            node->children[child] = child_index;
+            node->child_count++;
+        }
+
+        index = node->children[child];
+    }
+}
+
+// Skips and weighs pixels by alpha the way build_color_histogram() does
+inline void add_octree_row(Octree *tree, u32 *texels, int count, int alpha_threshold, bool weight_by_alpha) {
+    for (int i = 0; i < count; i++) {
+        int alpha = (int)(texels[i] >> 24);
+        if (alpha < alpha_threshold || (weight_by_alpha && !alpha)) continue;
+
+        double weight = weight_by_alpha ? (double)alpha / 255.0 : 1.0;
+        add_octree_pixel(tree, texels[i], weight);
+    }
+}
+
+// Reduces the tree to exactly cluster_count leaves, or to however many it has
+// if that's fewer. When folding a whole node would overshoot, just enough of
+// its lightest children are merged together instead.
+inline void reduce_octree(Octree *tree, int cluster_count) {
+    while (tree->leaf_count > cluster_count) {
+        int index = pop_lightest_reducible_node(tree);
+        Octree_Node *node = &tree->nodes[index];
+
+        int excess = tree->leaf_count - cluster_count;
+        if (node->child_count - 1 <= excess) {
+            reduce_octree_node(tree, index);
+            continue;
+        }
+
+        // Children in order of weight, lightest first
+        int children[8];
+        int child_count = 0;
+        for (int i = 0; i < 8; i++) {
+            int child_index = node->children[i];
+            if (!child_index) continue;
+
+            int slot = child_count++;
+            while (slot > 0 && tree->nodes[children[slot - 1]].weight > tree->nodes[child_index].weight) {
+                children[slot] = children[slot - 1];
+                slot--;
+            }
+            children[slot] = child_index;
+        }
+
+        Octree_Node *merged = &tree->nodes[children[0]];
+        for (int i = 1; i <= excess; i++) {
+            Octree_Node *child = &tree->nodes[children[i]];
+            merged->weight += child->weight;
+            merge_octree_moments(merged, child);
+            for (int j = 0; j < 8; j++) {
+                if (node->children[j] == children[i]) node->children[j] = 0;
+            }
+            free_octree_node(tree, children[i]);
+            node->child_count--;
+            tree->leaf_count--;
+        }
+    }
+}
+
+// Reduces the tree to its palette. The inertia is measured from every pixel
+// to the mean of the leaf it ended up in, which the moments give exactly;
+// assigning pixels to their nearest palette color instead could only lower
+// it.
+inline KMeans_Result take_octree_palette(Octree *tree, KMeans_Cluster *clusters, int cluster_count) {
+    KMeans_Result result = {};
+
+    reduce_octree(tree, cluster_count);
+
+    // Every node in use that's a leaf is one palette color
+    bool *in_use = (bool *)malloc(sizeof(bool)*tree->unused_node);
+    for (int i = 0; i < tree->unused_node; i++) in_use[i] = true;
+    for (int i = tree->free_node; i >= 0; i = tree->nodes[i].next) in_use[i] = false;
+
+    int leaf_count = 0;
+    int heaviest = 0;
+    for (int i = 0; i < tree->unused_node; i++) {
+        Octree_Node *node = &tree->nodes[i];
+        if (!in_use[i] || !node->leaf || node->weight <= 0.0) continue;
+        assert(leaf_count < cluster_count);
+
+        KMeans_Cluster *cluster = &clusters[leaf_count];
+        cluster->observation_sum = V3((float)node->l, (float)node->a, (float)node->b);
+        cluster->observation_weight = (float)node->weight;
+        cluster->centroid = V3((float)(node->l / node->weight), (float)(node->a / node->weight),
+                               (float)(node->b / node->weight));
+        result.inertia += node->squares - (node->l*node->l + node->a*node->a + node->b*node->b) / node->weight;
+
+        if (cluster->observation_weight > clusters[heaviest].observation_weight) heaviest = leaf_count;
+        leaf_count++;
+    }
+    for (int i = leaf_count; i < cluster_count; i++) {
+        clusters[i].centroid = clusters[heaviest].centroid;
+        clusters[i].observation_sum = V3i(0, 0, 0);
+        clusters[i].observation_weight = 0.0f;
+    }
+
+    result.inertia = maximum(0.0, result.inertia);
+    result.has_inertia = true;
+    result.converged = true;
+
+    free(in_use);
+
+    return result;
+}
+
+// Quantizes the sampled bitmap a row at a time
+inline KMeans_Result quantize_bitmap_octree(KMeans_Cluster *clusters, int cluster_count, Bitmap_Sampler sampler,
+                                            int alpha_threshold, bool weight_by_alpha) {
+    Octree tree;
+    create_octree(&tree);
+
+    u32 *scratch = (u32 *)malloc(sizeof(u32)*sampler.columns);
+    for (int y = 0; y < sampler.rows; y++) {
+        add_octree_row(&tree, read_bitmap_sample_row(&sampler, y, scratch), sampler.columns, alpha_threshold,
+                       weight_by_alpha);
+    }
+    free(scratch);
+
+    // Like the histogram, fall back to every pixel rather than return nothing
+    if (tree.nodes[0].weight <= 0.0 && (alpha_threshold > 0 || weight_by_alpha)) {
+        free_octree(&tree);
+        return quantize_bitmap_octree(clusters, cluster_count, sampler, 0, false);
+    }
+
+    KMeans_Result result = take_octree_palette(&tree, clusters, cluster_count);
+    free_octree(&tree);
+
+    return result;
+}
+
+// Quantizes every pixel of the file a row at a time, so only one row is ever
+// held. A 32-bit BMP whose alpha is all zero is read as opaque by stb_image;
+// here nothing passes the alpha test, so the fallback gives the same palette.
+inline KMeans_Result quantize_file_octree(KMeans_Cluster *clusters, int cluster_count, Row_Reader *reader,
+                                          int alpha_threshold, bool weight_by_alpha) {
+    Octree tree;
+    create_octree(&tree);
+
+    u32 *scratch = (u32 *)malloc(sizeof(u32)*reader->width);
+    for (int y = 0; y < reader->height; y++) {
+        add_octree_row(&tree, read_row(reader, y, scratch), reader->width, alpha_threshold, weight_by_alpha);
+    }
+    free(scratch);
+
+    if (tree.nodes[0].weight <= 0.0 && (alpha_threshold > 0 || weight_by_alpha)) {
+        free_octree(&tree);
+        return quantize_file_octree(clusters, cluster_count, reader, 0, false);
+    }
+
+    KMeans_Result result = take_octree_palette(&tree, clusters, cluster_count);
+    free_octree(&tree);
+
+    return result;
+}
+
+#endif
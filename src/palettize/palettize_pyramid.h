@@ -0,0 +1,98 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_PYRAMID_H
+#define PALETTIZE_PYRAMID_H
+
+// Coarse-to-fine k-means. The bitmap is clustered at PYRAMID_BASE_DIM pixels
+// on its longer side, then at PYRAMID_SCALE times that, and so on while the
+// extent stays below the one the caller will cluster at, each level seeded
+// with the centroids of the one before. Most of the moves happen on a few
+// hundred colors, so the caller's own pass, seeded with the last level's
+// centroids, only has to polish. That's what makes max_dim = 0 affordable.
+#define PYRAMID_BASE_DIM 25
+#define PYRAMID_SCALE 4
+#define PYRAMID_MAX_LEVELS 8
+
+// Methods without seeds, and the sweep over cluster counts, have nothing to
+// warm-start.
+inline bool can_cluster_pyramid(Palettize_Config *config) {
+    bool result = (config->pyramid && !config->auto_cluster_count && config->method != CLUSTER_METHOD_WU &&
+                   config->method != CLUSTER_METHOD_OCTREE && config->method != CLUSTER_METHOD_BISECTING);
+
+    return result;
+}
+
+// Clusters the coarse levels and leaves the last one's centroids in
+// centroids and each level's iteration count in level_iterations. Restarts
+// only happen on the coarsest level, where they're cheapest. Returns the
+// number of coarse levels, which is 0 if the bitmap is already sampled
+// coarsely enough or the method can't be warm-started.
+inline int cluster_bitmap_pyramid(Vector3 *centroids, int cluster_count, Bitmap bitmap, Palettize_Config *config,
+                                  Thread_Pool *pool, int *level_iterations) {
+    if (!can_cluster_pyramid(config)) return 0;
+
+    Bitmap_Sampler target = create_bitmap_sampler(bitmap, config);
+    int target_dim = maximum(target.columns, target.rows);
+
+    KMeans_Cluster *clusters = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count);
+    double *restart_inertias = (double *)malloc(sizeof(double)*maximum(1, config->restart_count));
+
+    int level_count = 0;
+    for (int dim = PYRAMID_BASE_DIM; dim < target_dim && level_count < PYRAMID_MAX_LEVELS; dim *= PYRAMID_SCALE) {
+        Palettize_Config level_config = *config;
+        level_config.max_dim = dim;
+        level_config.sample_size = 0;
+        if (level_count > 0) {
+            level_config.seed_method = SEED_METHOD_PALETTE;
+            level_config.initial_centroids = centroids;
+            level_config.initial_centroid_count = cluster_count;
+            level_config.restart_count = 1;
+        }
+
+        Bitmap_Sampler sampler = create_bitmap_sampler(bitmap, &level_config);
+        Observation_Buffer observations = convert_bitmap_to_cielab(sampler, config->alpha_threshold,
+                                                                   config->weight_by_alpha);
+        u8 *cluster_indices = (u8 *)malloc(sizeof(u8)*observations.count);
+
+        KMeans_Result result = cluster_observations_with_restarts(clusters, cluster_count, sampler, observations,
+                                                                  cluster_indices, &level_config, pool,
+                                                                  restart_inertias);
+        for (int i = 0; i < cluster_count; i++) {
+            centroids[i] = clusters[i].centroid;
+        }
+        level_iterations[level_count++] = result.iteration_count;
+
+        free(cluster_indices);
+        free_observation_buffer(&observations);
+    }
+
+    free(restart_inertias);
+    free(clusters);
+
+    return level_count;
+}
+
+#endif
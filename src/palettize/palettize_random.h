@@ -50,10 +50,18 @@ inline u32 random_u32(Random_Series *series) {
 }
 
 inline u32 random_u32_between(Random_Series *series, u32 min, u32 max) {
-    u32 result = min + (random_u32(series) % (max - min));
+    u32 result = min;
+    if (max > min) result += random_u32(series) % (max - min);
     assert(min <= result && result <= max);
 
     return result;
 }
 
+// Uniformly distributed in [0, 1)
+inline float random_unilateral(Random_Series *series) {
+    float result = (float)(random_u32(series) >> 8)*(1.0f / 16777216.0f);
+
+    return result;
+}
+
 #endif
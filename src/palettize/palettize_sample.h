@@ -0,0 +1,192 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_SAMPLE_H
+#define PALETTIZE_SAMPLE_H
+
+// Reads a budget of pixels straight out of the decoded bitmap instead of
+// resizing it first. The samples form a grid of columns by rows, which is the
+// whole bitmap when it's within budget; otherwise every sample is one of:
+//
+// - Grid: the pixel nearest each grid point, as nearest-neighbor resizing
+//   would pick. Cheap, but stripes and patterns near the grid spacing alias.
+// - Stratified: a uniformly random pixel inside each grid cell, so every
+//   region is still covered but regular patterns no longer line up.
+// - Halton: the (2, 3) Halton sequence, randomly shifted by the seed. Low
+//   discrepancy without any cell structure at all.
+//
+// Stratified and Halton samples only depend on their index and the seed, so
+// any sample can be read on its own and in any order.
+struct Bitmap_Sampler {
+    Bitmap bitmap;
+    Sample_Pattern pattern;
+    int columns;
+    int rows;
+    u32 seed;
+    double offset_x;
+    double offset_y;
+};
+
+// The columns and rows of samples read from a width by height bitmap. A pixel
+// budget replaces max_dim even when the bitmap is within it, and both keep
+// the aspect ratio of the bitmap.
+inline void get_sample_grid(int width, int height, Palettize_Config *config, int *columns, int *rows) {
+    *columns = width;
+    *rows = height;
+
+    float factor = 1.0f;
+    double texel_count = (double)width*(double)height;
+    if (config->sample_size > 0) {
+        if (texel_count > (double)config->sample_size) {
+            factor = (float)sqrt((double)config->sample_size / texel_count);
+        }
+    } else if (config->max_dim > 0 && (width > config->max_dim || height > config->max_dim)) {
+        factor = (float)config->max_dim / (float)maximum(width, height);
+    }
+    if (factor < 1.0f) {
+        *columns = maximum(1, roundi(width*factor));
+        *rows = maximum(1, roundi(height*factor));
+    }
+}
+
+inline bool reads_every_texel(int width, int height, Palettize_Config *config) {
+    int columns;
+    int rows;
+    get_sample_grid(width, height, config, &columns, &rows);
+    bool result = (columns == width && rows == height);
+
+    return result;
+}
+
+inline Bitmap_Sampler create_bitmap_sampler(Bitmap bitmap, Palettize_Config *config) {
+    Bitmap_Sampler result;
+    result.bitmap = bitmap;
+    result.pattern = config->sample_pattern;
+    result.seed = config->seed;
+    get_sample_grid(bitmap.width, bitmap.height, config, &result.columns, &result.rows);
+
+    Random_Series entropy = seed_series(config->seed ? config->seed : 1);
+    result.offset_x = random_unilateral(&entropy);
+    result.offset_y = random_unilateral(&entropy);
+
+    return result;
+}
+
+inline int get_sample_count(Bitmap_Sampler *sampler) {
+    int result = sampler->columns*sampler->rows;
+
+    return result;
+}
+
+inline bool samples_every_texel(Bitmap_Sampler *sampler) {
+    bool result = (sampler->columns == sampler->bitmap.width && sampler->rows == sampler->bitmap.height);
+
+    return result;
+}
+
+// Murmur3's finalizer, to turn a sample index into independent random bits
+inline u32 hash_u32(u32 x) {
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+
+    return x;
+}
+
+inline double radical_inverse(u32 index, u32 base) {
+    double result = 0.0;
+    double scale = 1.0 / (double)base;
+    while (index) {
+        result += (double)(index % base)*scale;
+        index /= base;
+        scale /= (double)base;
+    }
+
+    return result;
+}
+
+inline u32 get_bitmap_sample(Bitmap_Sampler *sampler, int column, int row) {
+    Bitmap bitmap = sampler->bitmap;
+    if (samples_every_texel(sampler)) {
+        return *(u32 *)get_bitmap_ptr(bitmap, column, row);
+    }
+
+    int sample_x = 0;
+    int sample_y = 0;
+    switch (sampler->pattern) {
+        case SAMPLE_PATTERN_GRID: {
+            // The same pixels resize_bitmap() used to keep
+            float u = (sampler->columns > 1) ? (float)column / ((float)sampler->columns - 1.0f) : 0.0f;
+            float v = (sampler->rows > 1) ? (float)row / ((float)sampler->rows - 1.0f) : 0.0f;
+            sample_x = roundi(u*((float)bitmap.width - 1.0f));
+            sample_y = roundi(v*((float)bitmap.height - 1.0f));
+        } break;
+
+        case SAMPLE_PATTERN_STRATIFIED: {
+            u32 bits = hash_u32(sampler->seed ^ hash_u32((u32)(row*sampler->columns + column)));
+            double jitter_x = (double)(bits & 0xFFFF)*(1.0 / 65536.0);
+            double jitter_y = (double)(bits >> 16)*(1.0 / 65536.0);
+            sample_x = (int)(((double)column + jitter_x)*(double)bitmap.width / (double)sampler->columns);
+            sample_y = (int)(((double)row + jitter_y)*(double)bitmap.height / (double)sampler->rows);
+        } break;
+
+        case SAMPLE_PATTERN_HALTON: {
+            // Index 0 is the origin in every base, so the sequence starts at 1
+            u32 index = (u32)(row*sampler->columns + column) + 1;
+            double u = radical_inverse(index, 2) + sampler->offset_x;
+            double v = radical_inverse(index, 3) + sampler->offset_y;
+            sample_x = (int)((u - floor(u))*(double)bitmap.width);
+            sample_y = (int)((v - floor(v))*(double)bitmap.height);
+        } break;
+
+        Invalid_Default_Case;
+    }
+
+    sample_x = clampi(0, sample_x, bitmap.width - 1);
+    sample_y = clampi(0, sample_y, bitmap.height - 1);
+
+    u32 result = *(u32 *)get_bitmap_ptr(bitmap, sample_x, sample_y);
+
+    return result;
+}
+
+// Returns a row of sampler->columns samples. At full resolution that's the
+// bitmap row itself; otherwise the samples are gathered into scratch, which
+// must hold sampler->columns texels.
+inline u32 *read_bitmap_sample_row(Bitmap_Sampler *sampler, int row, u32 *scratch) {
+    if (samples_every_texel(sampler)) {
+        return (u32 *)get_bitmap_ptr(sampler->bitmap, 0, row);
+    }
+
+    for (int column = 0; column < sampler->columns; column++) {
+        scratch[column] = get_bitmap_sample(sampler, column, row);
+    }
+
+    return scratch;
+}
+
+#endif
@@ -0,0 +1,616 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_SIMD_H
+#define PALETTIZE_SIMD_H
+
+// Nearest-centroid labelling kernels. Each kernel labels a run of
+// observations against a Centroid_Block, one SIMD lane per observation, and
+// the widest kernel the CPU supports is picked at runtime. Every path computes
+// dl*dl + da*da + db*db in the same order as length_squared() and keeps the
+// first of any tied centroids, so they all produce the same labels.
+//
+// The seeding kernels below follow the same rules, so seeding is also
+// independent of the SIMD level.
+//
+// That only holds if the compiler doesn't fuse the multiplies and adds:
+// AVX-512 implies FMA, and GCC contracts the intrinsics (which it implements
+// as plain vector arithmetic) into vfmadd by default. The package builds with
+// -ffp-contract=off everywhere, and the wide kernels turn contraction off
+// themselves, so a CLI built without the flag for a baseline x86-64 target
+// labels the same way too.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_AMD64)
+#define PALETTIZE_X86 1
+#include <immintrin.h>
+#else
+#define PALETTIZE_X86 0
+#endif
+
+#if PALETTIZE_X86 && defined(__clang__)
+// Clang only contracts within a single expression, which the intrinsics
+// never are
+#define PALETTIZE_TARGET(t) __attribute__((target(t)))
+#define PALETTIZE_WIDE_SIMD 1
+#elif PALETTIZE_X86 && defined(__GNUC__)
+#define PALETTIZE_TARGET(t) __attribute__((target(t), optimize("fp-contract=off")))
+#define PALETTIZE_WIDE_SIMD 1
+#else
+#define PALETTIZE_TARGET(t)
+#define PALETTIZE_WIDE_SIMD 0
+#endif
+
+enum SIMD_Level {
+    SIMD_LEVEL_SCALAR,
+    SIMD_LEVEL_SSE2,
+    SIMD_LEVEL_AVX2,
+    SIMD_LEVEL_AVX512,
+};
+
+inline void *allocate_aligned(size_t size, size_t alignment) {
+    u8 *unaligned = (u8 *)malloc(size + alignment + sizeof(void *));
+    if (!unaligned) return 0;
+
+    uintptr_t address = (uintptr_t)(unaligned + sizeof(void *));
+    u8 *result = (u8 *)((address + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    ((void **)result)[-1] = unaligned;
+
+    return result;
+}
+
+inline void free_aligned(void *memory) {
+    if (memory) free(((void **)memory)[-1]);
+}
+
+inline SIMD_Level query_simd_level() {
+    SIMD_Level result = SIMD_LEVEL_SCALAR;
+
+#if PALETTIZE_WIDE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        result = SIMD_LEVEL_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        result = SIMD_LEVEL_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        result = SIMD_LEVEL_SSE2;
+    }
+#elif PALETTIZE_X86
+    result = SIMD_LEVEL_SSE2;
+#endif
+
+    return result;
+}
+
+// Centroids are repacked into aligned L, a and b planes before every
+// assignment pass so the kernels can broadcast them with plain loads
+inline void allocate_centroid_block(Centroid_Block *block, int cluster_count) {
+    block->count = cluster_count;
+    block->capacity = (cluster_count + (SIMD_MAX_LANES - 1)) & ~(SIMD_MAX_LANES - 1);
+
+    float *memory = (float *)allocate_aligned(3*sizeof(float)*block->capacity, 64);
+    block->l = memory;
+    block->a = memory + block->capacity;
+    block->b = memory + 2*block->capacity;
+}
+
+inline void free_centroid_block(Centroid_Block *block) {
+    free_aligned(block->l);
+    block->l = block->a = block->b = 0;
+}
+
+inline void pack_centroid_block(Centroid_Block *block, KMeans_Cluster *clusters, int cluster_count) {
+    assert(cluster_count <= block->capacity);
+
+    block->count = cluster_count;
+    for (int i = 0; i < cluster_count; i++) {
+        block->l[i] = clusters[i].centroid.x;
+        block->a[i] = clusters[i].centroid.y;
+        block->b[i] = clusters[i].centroid.z;
+    }
+}
+
+// Scalar code that has to agree with the kernels computes distances here
+inline float cielab_distance_squared(float l, float a, float b, float cl, float ca, float cb) {
+    float dl = l - cl;
+    float da = a - ca;
+    float db = b - cb;
+
+    float result = dl*dl + da*da + db*db;
+
+    return result;
+}
+
+typedef void Label_Observations_Kernel(Observation_Buffer observations, int first, int count,
+                                       Centroid_Block centroids, u32 *labels);
+
+static void label_observations_scalar(Observation_Buffer observations, int first, int count,
+                                      Centroid_Block centroids, u32 *labels) {
+    for (int i = 0; i < count; i++) {
+        float l = observations.l[first + i];
+        float a = observations.a[first + i];
+        float b = observations.b[first + i];
+
+        float closest_dist_squared = FLOAT_MAX;
+        u32 closest_cluster_index = 0;
+        for (int j = 0; j < centroids.count; j++) {
+            float d = cielab_distance_squared(l, a, b, centroids.l[j], centroids.a[j], centroids.b[j]);
+            if (d < closest_dist_squared) {
+                closest_dist_squared = d;
+                closest_cluster_index = (u32)j;
+            }
+        }
+
+        labels[i] = closest_cluster_index;
+    }
+}
+
+#if PALETTIZE_X86
+// The SIMD kernels read whole vectors past the end of count, which is safe
+// because first is always a multiple of SIMD_MAX_LANES and observation planes
+// are padded out to one
+PALETTIZE_TARGET("sse2")
+static void label_observations_sse2(Observation_Buffer observations, int first, int count,
+                                    Centroid_Block centroids, u32 *labels) {
+    for (int i = 0; i < count; i += 4) {
+        __m128 l = _mm_loadu_ps(observations.l + first + i);
+        __m128 a = _mm_loadu_ps(observations.a + first + i);
+        __m128 b = _mm_loadu_ps(observations.b + first + i);
+
+        __m128 closest_dist_squared = _mm_set1_ps(FLOAT_MAX);
+        __m128i closest_cluster_index = _mm_setzero_si128();
+        for (int j = 0; j < centroids.count; j++) {
+            __m128 dl = _mm_sub_ps(l, _mm_set1_ps(centroids.l[j]));
+            __m128 da = _mm_sub_ps(a, _mm_set1_ps(centroids.a[j]));
+            __m128 db = _mm_sub_ps(b, _mm_set1_ps(centroids.b[j]));
+
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dl, dl), _mm_mul_ps(da, da)), _mm_mul_ps(db, db));
+            __m128 closer = _mm_cmplt_ps(d, closest_dist_squared);
+            __m128i closer_i = _mm_castps_si128(closer);
+
+            closest_dist_squared = _mm_or_ps(_mm_and_ps(closer, d), _mm_andnot_ps(closer, closest_dist_squared));
+            closest_cluster_index = _mm_or_si128(_mm_and_si128(closer_i, _mm_set1_epi32(j)),
+                                                 _mm_andnot_si128(closer_i, closest_cluster_index));
+        }
+
+        u32 lane_labels[4];
+        _mm_storeu_si128((__m128i *)lane_labels, closest_cluster_index);
+        for (int lane = 0; lane < 4 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+#endif
+
+#if PALETTIZE_WIDE_SIMD
+PALETTIZE_TARGET("avx2")
+static void label_observations_avx2(Observation_Buffer observations, int first, int count,
+                                    Centroid_Block centroids, u32 *labels) {
+    for (int i = 0; i < count; i += 8) {
+        __m256 l = _mm256_loadu_ps(observations.l + first + i);
+        __m256 a = _mm256_loadu_ps(observations.a + first + i);
+        __m256 b = _mm256_loadu_ps(observations.b + first + i);
+
+        __m256 closest_dist_squared = _mm256_set1_ps(FLOAT_MAX);
+        __m256 closest_cluster_index = _mm256_setzero_ps();
+        for (int j = 0; j < centroids.count; j++) {
+            __m256 dl = _mm256_sub_ps(l, _mm256_broadcast_ss(centroids.l + j));
+            __m256 da = _mm256_sub_ps(a, _mm256_broadcast_ss(centroids.a + j));
+            __m256 db = _mm256_sub_ps(b, _mm256_broadcast_ss(centroids.b + j));
+
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dl, dl), _mm256_mul_ps(da, da)), _mm256_mul_ps(db, db));
+            __m256 closer = _mm256_cmp_ps(d, closest_dist_squared, _CMP_LT_OQ);
+
+            closest_dist_squared = _mm256_blendv_ps(closest_dist_squared, d, closer);
+            closest_cluster_index = _mm256_blendv_ps(closest_cluster_index,
+                                                     _mm256_castsi256_ps(_mm256_set1_epi32(j)), closer);
+        }
+
+        u32 lane_labels[8];
+        _mm256_storeu_si256((__m256i *)lane_labels, _mm256_castps_si256(closest_cluster_index));
+        for (int lane = 0; lane < 8 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+
+PALETTIZE_TARGET("avx512f")
+static void label_observations_avx512(Observation_Buffer observations, int first, int count,
+                                      Centroid_Block centroids, u32 *labels) {
+    for (int i = 0; i < count; i += 16) {
+        __m512 l = _mm512_loadu_ps(observations.l + first + i);
+        __m512 a = _mm512_loadu_ps(observations.a + first + i);
+        __m512 b = _mm512_loadu_ps(observations.b + first + i);
+
+        __m512 closest_dist_squared = _mm512_set1_ps(FLOAT_MAX);
+        __m512i closest_cluster_index = _mm512_setzero_si512();
+        for (int j = 0; j < centroids.count; j++) {
+            __m512 dl = _mm512_sub_ps(l, _mm512_set1_ps(centroids.l[j]));
+            __m512 da = _mm512_sub_ps(a, _mm512_set1_ps(centroids.a[j]));
+            __m512 db = _mm512_sub_ps(b, _mm512_set1_ps(centroids.b[j]));
+
+            __m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dl, dl), _mm512_mul_ps(da, da)), _mm512_mul_ps(db, db));
+            __mmask16 closer = _mm512_cmp_ps_mask(d, closest_dist_squared, _CMP_LT_OQ);
+
+            closest_dist_squared = _mm512_mask_mov_ps(closest_dist_squared, closer, d);
+            closest_cluster_index = _mm512_mask_mov_epi32(closest_cluster_index, closer, _mm512_set1_epi32(j));
+        }
+
+        u32 lane_labels[16];
+        _mm512_storeu_si512(lane_labels, closest_cluster_index);
+        for (int lane = 0; lane < 16 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+#endif
+
+inline Label_Observations_Kernel *get_label_observations_kernel(SIMD_Level level) {
+    Label_Observations_Kernel *result = label_observations_scalar;
+
+    switch (level) {
+#if PALETTIZE_WIDE_SIMD
+        case SIMD_LEVEL_AVX512: result = label_observations_avx512; break;
+        case SIMD_LEVEL_AVX2: result = label_observations_avx2; break;
+#endif
+#if PALETTIZE_X86
+        case SIMD_LEVEL_SSE2: result = label_observations_sse2; break;
+#endif
+        default: break;
+    }
+
+    return result;
+}
+
+// Fixed-point labelling kernels. L, a and b are stored as s16 in units of
+// 1/CIELAB_FIXED_SCALE, which halves the bytes read per observation and
+// doubles the lanes per subtraction. Channels are clamped to [-128, 128], so
+// a difference always fits in 16 bits and a squared distance, at most
+// 3*16384^2, fits in 32. Integer distances are exact, so every path gives the
+// same labels, keeping the first of any tied centroids.
+//
+// Rounding moves each channel by at most 1/128 of a unit, so an observation
+// can only get a different label than the float kernels would give it when
+// its two nearest centroids are within about 0.03 units of being equidistant.
+#define CIELAB_FIXED_SCALE 64.0f
+#define CIELAB_FIXED_LIMIT 8192
+#define FIXED_SIMD_MAX_LANES 32
+
+inline s16 cielab_to_fixed(float value) {
+    s16 result = (s16)clampi(-CIELAB_FIXED_LIMIT, roundi(value*CIELAB_FIXED_SCALE), CIELAB_FIXED_LIMIT);
+
+    return result;
+}
+
+inline void allocate_fixed_centroid_block(Fixed_Centroid_Block *block, int cluster_count) {
+    block->count = cluster_count;
+    block->capacity = (cluster_count + (SIMD_MAX_LANES - 1)) & ~(SIMD_MAX_LANES - 1);
+
+    s16 *memory = (s16 *)allocate_aligned(3*sizeof(s16)*block->capacity, 64);
+    block->l = memory;
+    block->a = memory + block->capacity;
+    block->b = memory + 2*block->capacity;
+}
+
+inline void free_fixed_centroid_block(Fixed_Centroid_Block *block) {
+    free_aligned(block->l);
+    block->l = block->a = block->b = 0;
+}
+
+inline void pack_fixed_centroid_block(Fixed_Centroid_Block *block, KMeans_Cluster *clusters, int cluster_count) {
+    assert(cluster_count <= block->capacity);
+
+    block->count = cluster_count;
+    for (int i = 0; i < cluster_count; i++) {
+        block->l[i] = cielab_to_fixed(clusters[i].centroid.x);
+        block->a[i] = cielab_to_fixed(clusters[i].centroid.y);
+        block->b[i] = cielab_to_fixed(clusters[i].centroid.z);
+    }
+}
+
+typedef void Label_Fixed_Observations_Kernel(Observation_Buffer observations, int first, int count,
+                                             Fixed_Centroid_Block centroids, u32 *labels);
+
+static void label_fixed_observations_scalar(Observation_Buffer observations, int first, int count,
+                                            Fixed_Centroid_Block centroids, u32 *labels) {
+    for (int i = 0; i < count; i++) {
+        s32 l = observations.fixed_l[first + i];
+        s32 a = observations.fixed_a[first + i];
+        s32 b = observations.fixed_b[first + i];
+
+        s32 closest_dist_squared = INT32_MAX;
+        u32 closest_cluster_index = 0;
+        for (int j = 0; j < centroids.count; j++) {
+            s32 dl = l - centroids.l[j];
+            s32 da = a - centroids.a[j];
+            s32 db = b - centroids.b[j];
+
+            s32 d = dl*dl + da*da + db*db;
+            if (d < closest_dist_squared) {
+                closest_dist_squared = d;
+                closest_cluster_index = (u32)j;
+            }
+        }
+
+        labels[i] = closest_cluster_index;
+    }
+}
+
+#if PALETTIZE_X86
+// pmaddwd multiplies adjacent 16-bit pairs and sums them into 32 bits, so
+// interleaving dl with da gives dl*dl + da*da, and interleaving db with zero
+// gives db*db
+PALETTIZE_TARGET("sse2")
+static void label_fixed_observations_sse2(Observation_Buffer observations, int first, int count,
+                                          Fixed_Centroid_Block centroids, u32 *labels) {
+    __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < count; i += 8) {
+        __m128i l = _mm_loadu_si128((__m128i *)(observations.fixed_l + first + i));
+        __m128i a = _mm_loadu_si128((__m128i *)(observations.fixed_a + first + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(observations.fixed_b + first + i));
+
+        __m128i closest_dist_squared_lo = _mm_set1_epi32(INT32_MAX);
+        __m128i closest_dist_squared_hi = _mm_set1_epi32(INT32_MAX);
+        __m128i closest_cluster_index_lo = zero;
+        __m128i closest_cluster_index_hi = zero;
+        for (int j = 0; j < centroids.count; j++) {
+            __m128i dl = _mm_sub_epi16(l, _mm_set1_epi16(centroids.l[j]));
+            __m128i da = _mm_sub_epi16(a, _mm_set1_epi16(centroids.a[j]));
+            __m128i db = _mm_sub_epi16(b, _mm_set1_epi16(centroids.b[j]));
+            __m128i index = _mm_set1_epi32(j);
+
+            __m128i dlda = _mm_unpacklo_epi16(dl, da);
+            __m128i db0 = _mm_unpacklo_epi16(db, zero);
+            __m128i d = _mm_add_epi32(_mm_madd_epi16(dlda, dlda), _mm_madd_epi16(db0, db0));
+            __m128i closer = _mm_cmplt_epi32(d, closest_dist_squared_lo);
+            closest_dist_squared_lo = _mm_or_si128(_mm_and_si128(closer, d),
+                                                   _mm_andnot_si128(closer, closest_dist_squared_lo));
+            closest_cluster_index_lo = _mm_or_si128(_mm_and_si128(closer, index),
+                                                    _mm_andnot_si128(closer, closest_cluster_index_lo));
+
+            dlda = _mm_unpackhi_epi16(dl, da);
+            db0 = _mm_unpackhi_epi16(db, zero);
+            d = _mm_add_epi32(_mm_madd_epi16(dlda, dlda), _mm_madd_epi16(db0, db0));
+            closer = _mm_cmplt_epi32(d, closest_dist_squared_hi);
+            closest_dist_squared_hi = _mm_or_si128(_mm_and_si128(closer, d),
+                                                   _mm_andnot_si128(closer, closest_dist_squared_hi));
+            closest_cluster_index_hi = _mm_or_si128(_mm_and_si128(closer, index),
+                                                    _mm_andnot_si128(closer, closest_cluster_index_hi));
+        }
+
+        u32 lane_labels[8];
+        _mm_storeu_si128((__m128i *)lane_labels, closest_cluster_index_lo);
+        _mm_storeu_si128((__m128i *)(lane_labels + 4), closest_cluster_index_hi);
+        for (int lane = 0; lane < 8 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+#endif
+
+#if PALETTIZE_WIDE_SIMD
+// The 256-bit unpacks work within each 128-bit half, so the planes are
+// permuted once per load to keep observations 0-7 in the low results and
+// 8-15 in the high ones
+PALETTIZE_TARGET("avx2")
+static void label_fixed_observations_avx2(Observation_Buffer observations, int first, int count,
+                                          Fixed_Centroid_Block centroids, u32 *labels) {
+    __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < count; i += 16) {
+        __m256i l = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i *)(observations.fixed_l + first + i)), 0xD8);
+        __m256i a = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i *)(observations.fixed_a + first + i)), 0xD8);
+        __m256i b = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i *)(observations.fixed_b + first + i)), 0xD8);
+
+        __m256i closest_dist_squared_lo = _mm256_set1_epi32(INT32_MAX);
+        __m256i closest_dist_squared_hi = _mm256_set1_epi32(INT32_MAX);
+        __m256i closest_cluster_index_lo = zero;
+        __m256i closest_cluster_index_hi = zero;
+        for (int j = 0; j < centroids.count; j++) {
+            __m256i dl = _mm256_sub_epi16(l, _mm256_set1_epi16(centroids.l[j]));
+            __m256i da = _mm256_sub_epi16(a, _mm256_set1_epi16(centroids.a[j]));
+            __m256i db = _mm256_sub_epi16(b, _mm256_set1_epi16(centroids.b[j]));
+            __m256i index = _mm256_set1_epi32(j);
+
+            __m256i dlda = _mm256_unpacklo_epi16(dl, da);
+            __m256i db0 = _mm256_unpacklo_epi16(db, zero);
+            __m256i d = _mm256_add_epi32(_mm256_madd_epi16(dlda, dlda), _mm256_madd_epi16(db0, db0));
+            __m256i closer = _mm256_cmpgt_epi32(closest_dist_squared_lo, d);
+            closest_dist_squared_lo = _mm256_blendv_epi8(closest_dist_squared_lo, d, closer);
+            closest_cluster_index_lo = _mm256_blendv_epi8(closest_cluster_index_lo, index, closer);
+
+            dlda = _mm256_unpackhi_epi16(dl, da);
+            db0 = _mm256_unpackhi_epi16(db, zero);
+            d = _mm256_add_epi32(_mm256_madd_epi16(dlda, dlda), _mm256_madd_epi16(db0, db0));
+            closer = _mm256_cmpgt_epi32(closest_dist_squared_hi, d);
+            closest_dist_squared_hi = _mm256_blendv_epi8(closest_dist_squared_hi, d, closer);
+            closest_cluster_index_hi = _mm256_blendv_epi8(closest_cluster_index_hi, index, closer);
+        }
+
+        u32 lane_labels[16];
+        _mm256_storeu_si256((__m256i *)lane_labels, closest_cluster_index_lo);
+        _mm256_storeu_si256((__m256i *)(lane_labels + 8), closest_cluster_index_hi);
+        for (int lane = 0; lane < 16 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+
+// Same again with four 128-bit halves, so each 64-bit quarter of a plane is
+// paired with the one four quarters up
+PALETTIZE_TARGET("avx512f,avx512bw")
+static void label_fixed_observations_avx512(Observation_Buffer observations, int first, int count,
+                                            Fixed_Centroid_Block centroids, u32 *labels) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i order = _mm512_set_epi64(7, 3, 6, 2, 5, 1, 4, 0);
+    for (int i = 0; i < count; i += 32) {
+        __m512i l = _mm512_maskz_permutexvar_epi64(0xFF, order, _mm512_loadu_si512(observations.fixed_l + first + i));
+        __m512i a = _mm512_maskz_permutexvar_epi64(0xFF, order, _mm512_loadu_si512(observations.fixed_a + first + i));
+        __m512i b = _mm512_maskz_permutexvar_epi64(0xFF, order, _mm512_loadu_si512(observations.fixed_b + first + i));
+
+        __m512i closest_dist_squared_lo = _mm512_set1_epi32(INT32_MAX);
+        __m512i closest_dist_squared_hi = _mm512_set1_epi32(INT32_MAX);
+        __m512i closest_cluster_index_lo = zero;
+        __m512i closest_cluster_index_hi = zero;
+        for (int j = 0; j < centroids.count; j++) {
+            __m512i dl = _mm512_sub_epi16(l, _mm512_set1_epi16(centroids.l[j]));
+            __m512i da = _mm512_sub_epi16(a, _mm512_set1_epi16(centroids.a[j]));
+            __m512i db = _mm512_sub_epi16(b, _mm512_set1_epi16(centroids.b[j]));
+            __m512i index = _mm512_set1_epi32(j);
+
+            __m512i dlda = _mm512_unpacklo_epi16(dl, da);
+            __m512i db0 = _mm512_unpacklo_epi16(db, zero);
+            __m512i d = _mm512_add_epi32(_mm512_madd_epi16(dlda, dlda), _mm512_madd_epi16(db0, db0));
+            __mmask16 closer = _mm512_cmplt_epi32_mask(d, closest_dist_squared_lo);
+            closest_dist_squared_lo = _mm512_mask_mov_epi32(closest_dist_squared_lo, closer, d);
+            closest_cluster_index_lo = _mm512_mask_mov_epi32(closest_cluster_index_lo, closer, index);
+
+            dlda = _mm512_unpackhi_epi16(dl, da);
+            db0 = _mm512_unpackhi_epi16(db, zero);
+            d = _mm512_add_epi32(_mm512_madd_epi16(dlda, dlda), _mm512_madd_epi16(db0, db0));
+            closer = _mm512_cmplt_epi32_mask(d, closest_dist_squared_hi);
+            closest_dist_squared_hi = _mm512_mask_mov_epi32(closest_dist_squared_hi, closer, d);
+            closest_cluster_index_hi = _mm512_mask_mov_epi32(closest_cluster_index_hi, closer, index);
+        }
+
+        u32 lane_labels[32];
+        _mm512_storeu_si512(lane_labels, closest_cluster_index_lo);
+        _mm512_storeu_si512(lane_labels + 16, closest_cluster_index_hi);
+        for (int lane = 0; lane < 32 && i + lane < count; lane++) {
+            labels[i + lane] = lane_labels[lane];
+        }
+    }
+}
+#endif
+
+// 16-bit arithmetic on 512-bit vectors needs AVX-512BW on top of the
+// AVX-512F that SIMD_LEVEL_AVX512 guarantees
+inline Label_Fixed_Observations_Kernel *get_label_fixed_observations_kernel(SIMD_Level level) {
+    Label_Fixed_Observations_Kernel *result = label_fixed_observations_scalar;
+
+    switch (level) {
+#if PALETTIZE_WIDE_SIMD
+        case SIMD_LEVEL_AVX512: {
+            result = __builtin_cpu_supports("avx512bw") ? label_fixed_observations_avx512
+                                                        : label_fixed_observations_avx2;
+        } break;
+        case SIMD_LEVEL_AVX2: result = label_fixed_observations_avx2; break;
+#endif
+#if PALETTIZE_X86
+        case SIMD_LEVEL_SSE2: result = label_fixed_observations_sse2; break;
+#endif
+        default: break;
+    }
+
+    return result;
+}
+
+// Nearest-distance kernels for k-means++ seeding. Each one writes
+// min(nearest_dists[i], |observation - candidate|^2) to result_dists[i] for a
+// run of observations; result_dists may alias nearest_dists. Both arrays are
+// written in whole vectors, so like the planes they must be padded out to a
+// multiple of SIMD_MAX_LANES.
+typedef void Nearest_Distances_Kernel(Observation_Buffer observations, int first, int count, Vector3 candidate,
+                                      float *nearest_dists, float *result_dists);
+
+static void nearest_distances_scalar(Observation_Buffer observations, int first, int count, Vector3 candidate,
+                                     float *nearest_dists, float *result_dists) {
+    for (int i = 0; i < count; i++) {
+        float d = cielab_distance_squared(observations.l[first + i], observations.a[first + i], observations.b[first + i],
+                                          candidate.x, candidate.y, candidate.z);
+        result_dists[i] = minimum(d, nearest_dists[i]);
+    }
+}
+
+#if PALETTIZE_X86
+PALETTIZE_TARGET("sse2")
+static void nearest_distances_sse2(Observation_Buffer observations, int first, int count, Vector3 candidate,
+                                   float *nearest_dists, float *result_dists) {
+    __m128 cl = _mm_set1_ps(candidate.x);
+    __m128 ca = _mm_set1_ps(candidate.y);
+    __m128 cb = _mm_set1_ps(candidate.z);
+    for (int i = 0; i < count; i += 4) {
+        __m128 dl = _mm_sub_ps(_mm_loadu_ps(observations.l + first + i), cl);
+        __m128 da = _mm_sub_ps(_mm_loadu_ps(observations.a + first + i), ca);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(observations.b + first + i), cb);
+
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dl, dl), _mm_mul_ps(da, da)), _mm_mul_ps(db, db));
+        _mm_storeu_ps(result_dists + i, _mm_min_ps(d, _mm_loadu_ps(nearest_dists + i)));
+    }
+}
+#endif
+
+#if PALETTIZE_WIDE_SIMD
+PALETTIZE_TARGET("avx2")
+static void nearest_distances_avx2(Observation_Buffer observations, int first, int count, Vector3 candidate,
+                                   float *nearest_dists, float *result_dists) {
+    __m256 cl = _mm256_set1_ps(candidate.x);
+    __m256 ca = _mm256_set1_ps(candidate.y);
+    __m256 cb = _mm256_set1_ps(candidate.z);
+    for (int i = 0; i < count; i += 8) {
+        __m256 dl = _mm256_sub_ps(_mm256_loadu_ps(observations.l + first + i), cl);
+        __m256 da = _mm256_sub_ps(_mm256_loadu_ps(observations.a + first + i), ca);
+        __m256 db = _mm256_sub_ps(_mm256_loadu_ps(observations.b + first + i), cb);
+
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dl, dl), _mm256_mul_ps(da, da)), _mm256_mul_ps(db, db));
+        _mm256_storeu_ps(result_dists + i, _mm256_min_ps(d, _mm256_loadu_ps(nearest_dists + i)));
+    }
+}
+
+PALETTIZE_TARGET("avx512f")
+static void nearest_distances_avx512(Observation_Buffer observations, int first, int count, Vector3 candidate,
+                                     float *nearest_dists, float *result_dists) {
+    __m512 cl = _mm512_set1_ps(candidate.x);
+    __m512 ca = _mm512_set1_ps(candidate.y);
+    __m512 cb = _mm512_set1_ps(candidate.z);
+    for (int i = 0; i < count; i += 16) {
+        __m512 dl = _mm512_sub_ps(_mm512_loadu_ps(observations.l + first + i), cl);
+        __m512 da = _mm512_sub_ps(_mm512_loadu_ps(observations.a + first + i), ca);
+        __m512 db = _mm512_sub_ps(_mm512_loadu_ps(observations.b + first + i), cb);
+
+        __m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dl, dl), _mm512_mul_ps(da, da)), _mm512_mul_ps(db, db));
+        __m512 nearest = _mm512_loadu_ps(nearest_dists + i);
+        __mmask16 closer = _mm512_cmp_ps_mask(d, nearest, _CMP_LT_OQ);
+        _mm512_storeu_ps(result_dists + i, _mm512_mask_mov_ps(nearest, closer, d));
+    }
+}
+#endif
+
+inline Nearest_Distances_Kernel *get_nearest_distances_kernel(SIMD_Level level) {
+    Nearest_Distances_Kernel *result = nearest_distances_scalar;
+
+    switch (level) {
+#if PALETTIZE_WIDE_SIMD
+        case SIMD_LEVEL_AVX512: result = nearest_distances_avx512; break;
+        case SIMD_LEVEL_AVX2: result = nearest_distances_avx2; break;
+#endif
+#if PALETTIZE_X86
+        case SIMD_LEVEL_SSE2: result = nearest_distances_sse2; break;
+#endif
+        default: break;
+    }
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,215 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_STREAM_H
+#define PALETTIZE_STREAM_H
+
+// Reads an image a row at a time straight from its file, for the methods that
+// never need more than one row in memory. Only layouts whose rows sit at a
+// fixed offset in the file are handled: uncompressed 24-bit and 32-bit BMPs
+// and binary 8-bit PGMs and PPMs. Anything else is left to stb_image, which
+// decodes the whole image. Texels come out as RGBA bytes, the same as
+// stbi_load() gives with STBI_rgb_alpha.
+enum Row_Format {
+    ROW_FORMAT_BGR,
+    ROW_FORMAT_BGRA,
+    ROW_FORMAT_GRAY,
+    ROW_FORMAT_RGB,
+};
+
+struct Row_Reader {
+    FILE *file;
+    Row_Format format;
+    int width;
+    int height;
+
+    long data_offset;
+    long row_size;
+    bool bottom_up;
+    u8 *row;
+};
+
+// Skips whitespace and comments in a PNM header and reads the number after
+// them, or returns -1
+inline int read_pnm_header_value(FILE *file) {
+    int c = fgetc(file);
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) c = fgetc(file);
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            c = fgetc(file);
+        } else {
+            break;
+        }
+    }
+
+    int result = -1;
+    while (c >= '0' && c <= '9' && result < 1000000) {
+        result = ((result < 0) ? 0 : 10*result) + (c - '0');
+        c = fgetc(file);
+    }
+
+    // The character ending a value is consumed, which after the last one is
+    // the single whitespace character before the samples
+    if (c == EOF) result = -1;
+
+    return result;
+}
+
+inline bool read_bmp_layout(Row_Reader *reader) {
+    Bitmap_Header header;
+    if (fread(&header, sizeof(header), 1, reader->file) != 1) return false;
+
+    // Later headers add color masks and color spaces that stb_image honors,
+    // so only the plain BITMAPINFOHEADER is streamed
+    if (header.type != 0x4D42 || header.size != 40 || header.planes != 1 || header.compression != 0) return false;
+    if (header.bit_count != 24 && header.bit_count != 32) return false;
+    if (header.width <= 0 || header.height == 0 || header.height == INT32_MIN) return false;
+
+    reader->format = (header.bit_count == 32) ? ROW_FORMAT_BGRA : ROW_FORMAT_BGR;
+    reader->width = header.width;
+    reader->height = (header.height > 0) ? header.height : -header.height;
+    reader->data_offset = (long)header.off_bits;
+    reader->row_size = 4*(((long)header.bit_count*reader->width + 31) / 32);
+    reader->bottom_up = (header.height > 0);
+
+    return true;
+}
+
+inline bool read_pnm_layout(Row_Reader *reader) {
+    char magic[2];
+    if (fread(magic, 1, 2, reader->file) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+        return false;
+    }
+
+    int width = read_pnm_header_value(reader->file);
+    int height = read_pnm_header_value(reader->file);
+    int max_value = read_pnm_header_value(reader->file);
+
+    // stb_image reads other maximums as raw or 16-bit samples
+    if (width <= 0 || height <= 0 || max_value != 255) return false;
+
+    reader->format = (magic[1] == '6') ? ROW_FORMAT_RGB : ROW_FORMAT_GRAY;
+    reader->width = width;
+    reader->height = height;
+    reader->data_offset = ftell(reader->file);
+    reader->row_size = (long)width*((reader->format == ROW_FORMAT_RGB) ? 3 : 1);
+    reader->bottom_up = false;
+
+    return true;
+}
+
+// Returns false, with nothing left open, if the file isn't one of the
+// handled layouts or is too short to hold every row
+inline bool open_row_reader(Row_Reader *reader, const char *path) {
+    *reader = {};
+    reader->file = fopen(path, "rb");
+    if (!reader->file) return false;
+
+    bool result = read_bmp_layout(reader);
+    if (!result) {
+        fseek(reader->file, 0, SEEK_SET);
+        result = read_pnm_layout(reader);
+    }
+
+    if (result) {
+        fseek(reader->file, 0, SEEK_END);
+        long file_size = ftell(reader->file);
+        result = reader->data_offset > 0 && reader->row_size <= (file_size - reader->data_offset) / reader->height;
+    }
+
+    if (result) {
+        reader->row = (u8 *)malloc(reader->row_size);
+    } else {
+        fclose(reader->file);
+        reader->file = 0;
+    }
+
+    return result;
+}
+
+inline void close_row_reader(Row_Reader *reader) {
+    free(reader->row);
+    reader->row = 0;
+    if (reader->file) fclose(reader->file);
+    reader->file = 0;
+}
+
+// Returns row y, counting from the top, as reader->width texels in texels. A
+// row that can't be read comes back transparent black.
+inline u32 *read_row(Row_Reader *reader, int y, u32 *texels) {
+    assert(0 <= y && y < reader->height);
+
+    int file_row = reader->bottom_up ? (reader->height - 1 - y) : y;
+    if (fseek(reader->file, reader->data_offset + (long)file_row*reader->row_size, SEEK_SET) != 0 ||
+        fread(reader->row, 1, reader->row_size, reader->file) != (size_t)reader->row_size) {
+        memset(texels, 0, sizeof(u32)*reader->width);
+        return texels;
+    }
+
+    u8 *source = reader->row;
+    u8 *dest = (u8 *)texels;
+    switch (reader->format) {
+        case ROW_FORMAT_BGR: {
+            for (int x = 0; x < reader->width; x++, source += 3, dest += 4) {
+                dest[0] = source[2];
+                dest[1] = source[1];
+                dest[2] = source[0];
+                dest[3] = 0xFF;
+            }
+        } break;
+
+        case ROW_FORMAT_BGRA: {
+            for (int x = 0; x < reader->width; x++, source += 4, dest += 4) {
+                dest[0] = source[2];
+                dest[1] = source[1];
+                dest[2] = source[0];
+                dest[3] = source[3];
+            }
+        } break;
+
+        case ROW_FORMAT_GRAY: {
+            for (int x = 0; x < reader->width; x++, source += 1, dest += 4) {
+                dest[0] = dest[1] = dest[2] = source[0];
+                dest[3] = 0xFF;
+            }
+        } break;
+
+        case ROW_FORMAT_RGB: {
+            for (int x = 0; x < reader->width; x++, source += 3, dest += 4) {
+                dest[0] = source[0];
+                dest[1] = source[1];
+                dest[2] = source[2];
+                dest[3] = 0xFF;
+            }
+        } break;
+
+        Invalid_Default_Case;
+    }
+
+    return texels;
+}
+
+#endif
@@ -38,7 +38,7 @@ inline char flip_case(char c) {
     return result;
 }
 
-inline bool strings_match(char *a, char *b, bool case_sensitive = true) {
+inline bool strings_match(const char *a, const char *b, bool case_sensitive = true) {
     while (*a && *b) {
         if (*a == *b ||
             (!case_sensitive && *a == flip_case(*b))) {
@@ -54,4 +54,36 @@ inline bool strings_match(char *a, char *b, bool case_sensitive = true) {
     return result;
 }
 
+inline int hex_digit_value(char c) {
+    int result = -1;
+
+    if ('0' <= c && c <= '9') {
+        result = c - '0';
+    } else if ('a' <= c && c <= 'f') {
+        result = 10 + (c - 'a');
+    } else if ('A' <= c && c <= 'F') {
+        result = 10 + (c - 'A');
+    }
+
+    return result;
+}
+
+// Parses six hex digits, optionally after a '#', into a color packed the way
+// bitmaps are (red in the low byte). Returns a pointer past the digits, or
+// null if they aren't there.
+inline const char *parse_hex_color(const char *s, u32 *color) {
+    if (*s == '#') s++;
+
+    u32 rgb = 0;
+    for (int i = 0; i < 6; i++) {
+        int digit = hex_digit_value(s[i]);
+        if (digit < 0) return 0;
+        rgb = (rgb << 4) | (u32)digit;
+    }
+
+    *color = ((rgb >> 16) & 0xFF) | (rgb & 0xFF00) | ((rgb & 0xFF) << 16) | 0xFF000000;
+
+    return s + 6;
+}
+
 #endif
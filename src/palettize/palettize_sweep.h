@@ -0,0 +1,343 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_SWEEP_H
+#define PALETTIZE_SWEEP_H
+
+// Picking the cluster count. Every count from 1 up to the maximum is
+// clustered over the same observation buffer, each warm-started from the
+// clusters of the count before it plus one new seed, so later counts only
+// need a few passes. Each count gets a score under the chosen criterion, and
+// the best one wins:
+//
+// - Elbow: how far the count's inertia, scaled to [0, 1] over the sweep, falls
+//   below the straight line from the first count to the last (the "Kneedle"
+//   rule of Satopaa et al.).
+// - Silhouette: the mean silhouette of a weighted sample of the observations,
+//   labelled by their nearest cluster. It needs at least two clusters.
+// - BIC: the Bayesian information criterion of a mixture of spherical
+//   Gaussians with the clusters as means, as in X-means (Pelleg and Moore).
+//
+// Scores that don't apply to a count are NAN.
+#define SILHOUETTE_SAMPLE_SIZE 1000
+
+// Adds a seed drawn with probability proportional to its weighted squared
+// distance from the nearest existing cluster, as k-means++ would
+inline void add_warm_start_seed(KMeans_Cluster *clusters, int cluster_count, Observation_Buffer observations,
+                                double *cumulative_potentials, Random_Series *entropy) {
+    Label_Observations_Kernel *label_observations = get_label_observations_kernel(query_simd_level());
+
+    Centroid_Block centroids;
+    allocate_centroid_block(&centroids, cluster_count);
+    pack_centroid_block(&centroids, clusters, cluster_count);
+
+    const int block_size = 256;
+    u32 labels[block_size];
+
+    double total_potential = 0.0;
+    for (int first = 0; first < observations.count; first += block_size) {
+        int count = minimum(block_size, observations.count - first);
+        label_observations(observations, first, count, centroids, labels);
+
+        for (int i = 0; i < count; i++) {
+            u32 j = labels[i];
+            float d = cielab_distance_squared(observations.l[first + i], observations.a[first + i],
+                                              observations.b[first + i],
+                                              centroids.l[j], centroids.a[j], centroids.b[j]);
+            total_potential += (double)(observations.weights[first + i]*d);
+            cumulative_potentials[first + i] = total_potential;
+        }
+    }
+
+    free_centroid_block(&centroids);
+
+    // Every observation already coincides with a cluster, so the new one
+    // repeats the first
+    KMeans_Cluster *seed = &clusters[cluster_count];
+    *seed = clusters[0];
+    seed->observation_sum = V3i(0, 0, 0);
+    seed->observation_weight = 0.0f;
+    if (total_potential <= 0.0) return;
+
+    double target = random_unilateral(entropy)*total_potential;
+
+    int lo = 0;
+    int hi = observations.count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (cumulative_potentials[mid] <= target) lo = mid + 1; else hi = mid;
+    }
+
+    seed->centroid = get_observation(observations, lo);
+}
+
+struct Silhouette_Sample {
+    int count;
+    Vector3 *points;
+
+    // Distances between every pair of points, row by row
+    float *dists;
+};
+
+inline void draw_silhouette_sample(Silhouette_Sample *sample, Observation_Buffer observations,
+                                   double *cumulative_weights, Random_Series *entropy) {
+    double total_weight = 0.0;
+    for (int i = 0; i < observations.count; i++) {
+        total_weight += observations.weights[i];
+        cumulative_weights[i] = total_weight;
+    }
+
+    sample->count = SILHOUETTE_SAMPLE_SIZE;
+    sample->points = (Vector3 *)malloc(sizeof(Vector3)*sample->count);
+    sample->dists = (float *)malloc(sizeof(float)*sample->count*sample->count);
+    for (int s = 0; s < sample->count; s++) {
+        double target = random_unilateral(entropy)*total_weight;
+
+        int lo = 0;
+        int hi = observations.count - 1;
+        while (lo < hi) {
+            int mid = lo + (hi - lo)/2;
+            if (cumulative_weights[mid] <= target) lo = mid + 1; else hi = mid;
+        }
+
+        sample->points[s] = get_observation(observations, lo);
+    }
+
+    for (int s = 0; s < sample->count; s++) {
+        Vector3 p = sample->points[s];
+        for (int t = 0; t < sample->count; t++) {
+            Vector3 q = sample->points[t];
+            sample->dists[s*sample->count + t] = sqrt(cielab_distance_squared(p.x, p.y, p.z, q.x, q.y, q.z));
+        }
+    }
+}
+
+inline void free_silhouette_sample(Silhouette_Sample *sample) {
+    free(sample->dists);
+    free(sample->points);
+    sample->points = 0;
+    sample->dists = 0;
+}
+
+// Points alone in their cluster count as 0, as in Rousseeuw's definition
+inline double measure_silhouette(Silhouette_Sample *sample, KMeans_Cluster *clusters, int cluster_count) {
+    if (cluster_count < 2) return NAN;
+
+    int *labels = (int *)malloc(sizeof(int)*sample->count);
+    int *sizes = (int *)calloc(cluster_count, sizeof(int));
+    for (int s = 0; s < sample->count; s++) {
+        Vector3 p = sample->points[s];
+        float closest_dist_squared = FLOAT_MAX;
+        for (int j = 0; j < cluster_count; j++) {
+            Vector3 c = clusters[j].centroid;
+            float d = cielab_distance_squared(p.x, p.y, p.z, c.x, c.y, c.z);
+            if (d < closest_dist_squared) {
+                closest_dist_squared = d;
+                labels[s] = j;
+            }
+        }
+        sizes[labels[s]]++;
+    }
+
+    double *dist_sums = (double *)malloc(sizeof(double)*cluster_count);
+    double result = 0.0;
+    for (int s = 0; s < sample->count; s++) {
+        int own = labels[s];
+        if (sizes[own] < 2) continue;
+
+        memset(dist_sums, 0, sizeof(double)*cluster_count);
+        float *dists = sample->dists + s*sample->count;
+        for (int t = 0; t < sample->count; t++) {
+            dist_sums[labels[t]] += dists[t];
+        }
+
+        double a = dist_sums[own] / (double)(sizes[own] - 1);
+        double b = DBL_MAX;
+        for (int j = 0; j < cluster_count; j++) {
+            if (j == own || !sizes[j]) continue;
+            b = minimum(b, dist_sums[j] / (double)sizes[j]);
+        }
+
+        // Every sampled point can land in one cluster
+        if (b == DBL_MAX) continue;
+        double denominator = maximum(a, b);
+        if (denominator > 0.0) result += (b - a) / denominator;
+    }
+    result /= (double)sample->count;
+
+    free(dist_sums);
+    free(sizes);
+    free(labels);
+
+    return result;
+}
+
+// Each pixel counts as one point, so the sample size is the total weight
+inline double measure_bic(KMeans_Cluster *clusters, int cluster_count, double inertia, double total_weight) {
+    const double dimension_count = 3.0;
+    const double pi = 3.14159265358979323846;
+
+    double degrees_of_freedom = total_weight - (double)cluster_count;
+    if (degrees_of_freedom <= 0.0) return NAN;
+
+    // A palette that fits every color exactly would have no variance at all
+    double variance = maximum(inertia / (dimension_count*degrees_of_freedom), 1e-6);
+
+    double log_likelihood = -0.5*total_weight*dimension_count*log(2.0*pi*variance) -
+                            0.5*dimension_count*degrees_of_freedom;
+    for (int j = 0; j < cluster_count; j++) {
+        double weight = clusters[j].observation_weight;
+        if (weight > 0.0) log_likelihood += weight*log(weight / total_weight);
+    }
+
+    double parameter_count = (double)cluster_count*(dimension_count + 1.0);
+    double result = log_likelihood - 0.5*parameter_count*log(total_weight);
+
+    return result;
+}
+
+inline void score_elbow(double *inertias, int cluster_count, double *scores) {
+    double first = inertias[0];
+    double last = inertias[cluster_count - 1];
+    for (int k = 1; k <= cluster_count; k++) {
+        scores[k - 1] = NAN;
+        if (cluster_count < 3 || first <= last) continue;
+
+        double x = (double)(k - 1) / (double)(cluster_count - 1);
+        double y = (inertias[k - 1] - last) / (first - last);
+        scores[k - 1] = (1.0 - x) - y;
+    }
+}
+
+// Clusters every count from 1 to cluster_count and leaves the best in
+// clusters, its count in chosen_count and, if they aren't null, every
+// count's score and inertia in scores and inertias. Methods without seeds
+// cluster each count from scratch; bisecting k-means yields every count in a
+// single run.
+inline KMeans_Result cluster_observations_sweep(KMeans_Cluster *clusters, int cluster_count, int *chosen_count,
+                                                double *scores, double *inertias, Bitmap_Sampler sampler,
+                                                Observation_Buffer observations, u8 *prev_cluster_indices,
+                                                Palettize_Config *config, Thread_Pool *pool) {
+    KMeans_Result result = {};
+    result.converged = true;
+
+    Random_Series entropy = seed_series(config->seed);
+
+    bool quantized = false;
+    if (config->fixed_point && config->method == CLUSTER_METHOD_LLOYD && !observations.fixed_l) {
+        quantize_observations(&observations);
+        quantized = true;
+    }
+
+    // The palette for k colors starts at palettes[k*(k - 1)/2]
+    KMeans_Cluster *palettes = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count*(cluster_count + 1)/2);
+    double *count_inertias = (double *)malloc(sizeof(double)*cluster_count);
+    double *count_scores = (double *)malloc(sizeof(double)*cluster_count);
+    double *cumulative = (double *)malloc(sizeof(double)*observations.count);
+
+    if (config->method == CLUSTER_METHOD_BISECTING) {
+        result = cluster_observations_bisecting(clusters, palettes, cluster_count, observations,
+                                                prev_cluster_indices, config, pool);
+        for (int k = 1; k <= cluster_count; k++) {
+            count_inertias[k - 1] = measure_inertia(palettes + k*(k - 1)/2, k, observations, pool);
+        }
+    } else {
+        for (int k = 1; k <= cluster_count; k++) {
+            KMeans_Cluster *palette = palettes + k*(k - 1)/2;
+            if (k == 1) {
+                seed_clusters(palette, 1, sampler, observations, config, &entropy, pool);
+            } else {
+                memcpy(palette, palette - (k - 1), sizeof(KMeans_Cluster)*(k - 1));
+                add_warm_start_seed(palette, k - 1, observations, cumulative, &entropy);
+            }
+
+            KMeans_Result count_result = cluster_observations(palette, k, observations, prev_cluster_indices,
+                                                              config, &entropy, pool);
+            if (!count_result.has_inertia) {
+                count_result.inertia = measure_inertia(palette, k, observations, pool);
+            }
+
+            count_inertias[k - 1] = count_result.inertia;
+            result.iteration_count += count_result.iteration_count;
+            if (!count_result.converged) result.converged = false;
+        }
+    }
+
+    Silhouette_Sample sample = {};
+    switch (config->count_criterion) {
+        case COUNT_CRITERION_ELBOW: {
+            score_elbow(count_inertias, cluster_count, count_scores);
+        } break;
+
+        case COUNT_CRITERION_SILHOUETTE: {
+            draw_silhouette_sample(&sample, observations, cumulative, &entropy);
+            for (int k = 1; k <= cluster_count; k++) {
+                count_scores[k - 1] = measure_silhouette(&sample, palettes + k*(k - 1)/2, k);
+            }
+            free_silhouette_sample(&sample);
+        } break;
+
+        case COUNT_CRITERION_BIC: {
+            for (int k = 1; k <= cluster_count; k++) {
+                count_scores[k - 1] = measure_bic(palettes + k*(k - 1)/2, k, count_inertias[k - 1],
+                                                  observations.total_weight);
+            }
+        } break;
+
+        Invalid_Default_Case;
+    }
+
+    // Ties go to the smaller count, and with no score at all (say, every
+    // inertia is 0) a single cluster is kept
+    int best = 1;
+    bool scored = false;
+    for (int k = 1; k <= cluster_count; k++) {
+        double score = count_scores[k - 1];
+        if (isnan(score)) continue;
+        if (!scored || score > count_scores[best - 1]) {
+            best = k;
+            scored = true;
+        }
+    }
+
+    *chosen_count = best;
+    memcpy(clusters, palettes + best*(best - 1)/2, sizeof(KMeans_Cluster)*best);
+    result.inertia = count_inertias[best - 1];
+    result.has_inertia = true;
+
+    if (scores) memcpy(scores, count_scores, sizeof(double)*cluster_count);
+    if (inertias) memcpy(inertias, count_inertias, sizeof(double)*cluster_count);
+
+    free(cumulative);
+    free(count_scores);
+    free(count_inertias);
+    free(palettes);
+
+    if (quantized) free_fixed_observations(&observations);
+
+    return result;
+}
+
+#endif
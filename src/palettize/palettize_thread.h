@@ -0,0 +1,152 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_THREAD_H
+#define PALETTIZE_THREAD_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// A fixed set of worker threads that run batches of indexed tasks. The thread
+// that calls run_parallel() works through the batch alongside the workers and
+// returns once every task has finished, so a pool of one thread is just a
+// plain loop.
+
+typedef void Parallel_Task(void *data, int task_index);
+
+struct Thread_Pool {
+    int thread_count;
+    std::thread *workers;
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_finished;
+
+    Parallel_Task *task;
+    void *task_data;
+    int task_count;
+    int next_task_index;
+    int completed_task_count;
+    u32 generation;
+    bool shutting_down;
+};
+
+// Must be called with pool->mutex held through lock
+inline void run_available_tasks(Thread_Pool *pool, std::unique_lock<std::mutex> &lock) {
+    while (pool->next_task_index < pool->task_count) {
+        int task_index = pool->next_task_index++;
+        Parallel_Task *task = pool->task;
+        void *task_data = pool->task_data;
+
+        lock.unlock();
+        task(task_data, task_index);
+        lock.lock();
+
+        if (++pool->completed_task_count == pool->task_count) {
+            pool->work_finished.notify_all();
+        }
+    }
+}
+
+inline void thread_pool_worker(Thread_Pool *pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+
+    u32 seen_generation = pool->generation;
+    for (;;) {
+        while (!pool->shutting_down && pool->generation == seen_generation) {
+            pool->work_available.wait(lock);
+        }
+        if (pool->shutting_down) break;
+
+        seen_generation = pool->generation;
+        run_available_tasks(pool, lock);
+    }
+}
+
+// A thread_count of zero uses every hardware thread
+inline void create_thread_pool(Thread_Pool *pool, int thread_count) {
+    if (thread_count <= 0) {
+        thread_count = maximum(1, (int)std::thread::hardware_concurrency());
+    }
+
+    pool->thread_count = thread_count;
+    pool->task = 0;
+    pool->task_data = 0;
+    pool->task_count = 0;
+    pool->next_task_index = 0;
+    pool->completed_task_count = 0;
+    pool->generation = 0;
+    pool->shutting_down = false;
+
+    pool->workers = 0;
+    if (thread_count > 1) {
+        pool->workers = new std::thread[thread_count - 1];
+        for (int i = 0; i < thread_count - 1; i++) {
+            pool->workers[i] = std::thread(thread_pool_worker, pool);
+        }
+    }
+}
+
+inline void destroy_thread_pool(Thread_Pool *pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->shutting_down = true;
+    }
+    pool->work_available.notify_all();
+
+    for (int i = 0; i < pool->thread_count - 1; i++) {
+        pool->workers[i].join();
+    }
+    delete[] pool->workers;
+    pool->workers = 0;
+}
+
+// Runs task(data, i) for every i in [0, task_count). A null pool runs the
+// tasks in order on the calling thread.
+inline void run_parallel(Thread_Pool *pool, int task_count, Parallel_Task *task, void *data) {
+    if (!pool || pool->thread_count <= 1 || task_count <= 1) {
+        for (int i = 0; i < task_count; i++) {
+            task(data, i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->task = task;
+    pool->task_data = data;
+    pool->task_count = task_count;
+    pool->next_task_index = 0;
+    pool->completed_task_count = 0;
+    pool->generation++;
+    pool->work_available.notify_all();
+
+    run_available_tasks(pool, lock);
+    while (pool->completed_task_count < pool->task_count) {
+        pool->work_finished.wait(lock);
+    }
+}
+
+#endif
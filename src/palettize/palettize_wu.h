@@ -0,0 +1,264 @@
+// This file is part of palettize -- A palette generator based on k-means
+// clustering with CIELAB colors.
+//
+// MIT License
+//
+// Copyright (c) 2021 gvlsq
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PALETTIZE_WU_H
+#define PALETTIZE_WU_H
+
+// Wu's color quantizer (Xiaolin Wu, "Efficient Statistical Computations for
+// Optimal Color Quantization", Graphics Gems II). Observations are binned on
+// a WU_BINS^3 grid spanning their CIELAB bounding box, and the bins' moments
+// are summed into a cumulative table, so the weight, mean and variance of any
+// box of bins take eight lookups. Starting from the whole grid, the box with
+// the largest variance is split wherever along whichever axis leaves the
+// least variance in its two halves, until there are cluster_count boxes. It
+// takes one pass over the observations and no iterations, and each box's mean
+// is exact because the moments are summed from the observations themselves
+// rather than from bin centers.
+#define WU_BINS 32
+#define WU_SIDE (WU_BINS + 1)
+
+struct Wu_Moment {
+    double weight;
+    double l;
+    double a;
+    double b;
+    double squares;
+};
+
+// Boxes span the bins lo (exclusive) to hi (inclusive) on each axis
+struct Wu_Box {
+    int lo[3];
+    int hi[3];
+};
+
+inline int wu_index(int l, int a, int b) {
+    int result = (l*WU_SIDE + a)*WU_SIDE + b;
+
+    return result;
+}
+
+inline void add_moment(Wu_Moment *dest, Wu_Moment m, double sign) {
+    dest->weight += sign*m.weight;
+    dest->l += sign*m.l;
+    dest->a += sign*m.a;
+    dest->b += sign*m.b;
+    dest->squares += sign*m.squares;
+}
+
+inline Wu_Moment box_moment(Wu_Moment *table, Wu_Box *box) {
+    Wu_Moment result = {};
+
+    for (int corner = 0; corner < 8; corner++) {
+        int l = (corner & 4) ? box->hi[0] : box->lo[0];
+        int a = (corner & 2) ? box->hi[1] : box->lo[1];
+        int b = (corner & 1) ? box->hi[2] : box->lo[2];
+
+        // Inclusion-exclusion: corners with an odd number of lo coordinates
+        // are subtracted
+        int lo_count = !(corner & 4) + !(corner & 2) + !(corner & 1);
+        add_moment(&result, table[wu_index(l, a, b)], (lo_count & 1) ? -1.0 : 1.0);
+    }
+
+    return result;
+}
+
+// The squared length of a box's summed position over its weight. Maximizing
+// this summed over both halves of a cut is the same as minimizing their
+// combined variance.
+inline double moment_spread(Wu_Moment m) {
+    double result = (m.l*m.l + m.a*m.a + m.b*m.b) / m.weight;
+
+    return result;
+}
+
+inline double box_variance(Wu_Moment *table, Wu_Box *box) {
+    double result = 0.0;
+
+    int volume = (box->hi[0] - box->lo[0])*(box->hi[1] - box->lo[1])*(box->hi[2] - box->lo[2]);
+    if (volume > 1) {
+        Wu_Moment m = box_moment(table, box);
+        if (m.weight > 0.0) result = m.squares - moment_spread(m);
+    }
+
+    return result;
+}
+
+// Splits box in two, leaving one half in box and the other in new_box.
+// Returns false if no cut leaves weight on both sides.
+inline bool cut_box(Wu_Moment *table, Wu_Box *box, Wu_Box *new_box) {
+    bool result = false;
+
+    Wu_Moment whole = box_moment(table, box);
+
+    double best_spread = 0.0;
+    int best_axis = 0;
+    int best_cut = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        for (int cut = box->lo[axis] + 1; cut < box->hi[axis]; cut++) {
+            Wu_Box half = *box;
+            half.hi[axis] = cut;
+
+            Wu_Moment lower = box_moment(table, &half);
+            Wu_Moment upper = whole;
+            add_moment(&upper, lower, -1.0);
+            if (lower.weight <= 0.0 || upper.weight <= 0.0) continue;
+
+            double spread = moment_spread(lower) + moment_spread(upper);
+            if (!result || spread > best_spread) {
+                best_spread = spread;
+                best_axis = axis;
+                best_cut = cut;
+                result = true;
+            }
+        }
+    }
+
+    if (result) {
+        *new_box = *box;
+        new_box->lo[best_axis] = best_cut;
+        box->hi[best_axis] = best_cut;
+    }
+
+    return result;
+}
+
+// Fills clusters with the means and weights of up to cluster_count boxes and
+// returns how many boxes there were. When the observations fall into fewer
+// bins than that, the remaining clusters repeat the heaviest box's mean with
+// no weight.
+inline int quantize_observations_wu(KMeans_Cluster *clusters, int cluster_count, Observation_Buffer observations) {
+    float *planes[3] = {observations.l, observations.a, observations.b};
+    float mins[3];
+    float scales[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float min = FLOAT_MAX;
+        float max = -FLOAT_MAX;
+        for (int i = 0; i < observations.count; i++) {
+            min = minimum(min, planes[axis][i]);
+            max = maximum(max, planes[axis][i]);
+        }
+
+        mins[axis] = min;
+        scales[axis] = (max > min) ? (float)WU_BINS / (max - min) : 0.0f;
+    }
+
+    Wu_Moment *table = (Wu_Moment *)calloc(WU_SIDE*WU_SIDE*WU_SIDE, sizeof(Wu_Moment));
+    for (int i = 0; i < observations.count; i++) {
+        int bins[3];
+        for (int axis = 0; axis < 3; axis++) {
+            int bin = (int)((planes[axis][i] - mins[axis])*scales[axis]);
+            bins[axis] = 1 + clampi(0, bin, WU_BINS - 1);
+        }
+
+        double weight = (double)observations.weights[i];
+        double l = (double)observations.l[i];
+        double a = (double)observations.a[i];
+        double b = (double)observations.b[i];
+
+        Wu_Moment *m = &table[wu_index(bins[0], bins[1], bins[2])];
+        m->weight += weight;
+        m->l += weight*l;
+        m->a += weight*a;
+        m->b += weight*b;
+        m->squares += weight*(l*l + a*a + b*b);
+    }
+
+    // Cumulative sums along each axis in turn turn every entry into the sum
+    // of the box from the origin to it
+    for (int l = 1; l < WU_SIDE; l++) {
+        for (int a = 1; a < WU_SIDE; a++) {
+            for (int b = 1; b < WU_SIDE; b++) {
+                add_moment(&table[wu_index(l, a, b)], table[wu_index(l, a, b - 1)], 1.0);
+            }
+        }
+    }
+    for (int l = 1; l < WU_SIDE; l++) {
+        for (int a = 1; a < WU_SIDE; a++) {
+            for (int b = 1; b < WU_SIDE; b++) {
+                add_moment(&table[wu_index(l, a, b)], table[wu_index(l, a - 1, b)], 1.0);
+            }
+        }
+    }
+    for (int l = 1; l < WU_SIDE; l++) {
+        for (int a = 1; a < WU_SIDE; a++) {
+            for (int b = 1; b < WU_SIDE; b++) {
+                add_moment(&table[wu_index(l, a, b)], table[wu_index(l - 1, a, b)], 1.0);
+            }
+        }
+    }
+
+    Wu_Box *boxes = (Wu_Box *)malloc(sizeof(Wu_Box)*cluster_count);
+    double *variances = (double *)malloc(sizeof(double)*cluster_count);
+    for (int axis = 0; axis < 3; axis++) {
+        boxes[0].lo[axis] = 0;
+        boxes[0].hi[axis] = WU_BINS;
+    }
+    variances[0] = box_variance(table, &boxes[0]);
+
+    int box_count = 1;
+    int next = 0;
+    while (box_count < cluster_count) {
+        if (cut_box(table, &boxes[next], &boxes[box_count])) {
+            variances[next] = box_variance(table, &boxes[next]);
+            variances[box_count] = box_variance(table, &boxes[box_count]);
+            box_count++;
+        } else {
+            variances[next] = 0.0;
+        }
+
+        next = 0;
+        for (int i = 1; i < box_count; i++) {
+            if (variances[i] > variances[next]) next = i;
+        }
+        if (variances[next] <= 0.0) break;
+    }
+
+    int heaviest = 0;
+    for (int i = 0; i < box_count; i++) {
+        KMeans_Cluster *cluster = &clusters[i];
+
+        Wu_Moment m = box_moment(table, &boxes[i]);
+        cluster->observation_sum = V3((float)m.l, (float)m.a, (float)m.b);
+        cluster->observation_weight = (float)m.weight;
+        cluster->centroid = (m.weight > 0.0) ? V3((float)(m.l / m.weight), (float)(m.a / m.weight),
+                                                  (float)(m.b / m.weight))
+                                             : V3i(0, 0, 0);
+
+        if (cluster->observation_weight > clusters[heaviest].observation_weight) heaviest = i;
+    }
+    for (int i = box_count; i < cluster_count; i++) {
+        clusters[i].centroid = clusters[heaviest].centroid;
+        clusters[i].observation_sum = V3i(0, 0, 0);
+        clusters[i].observation_weight = 0.0f;
+    }
+
+    free(variances);
+    free(boxes);
+    free(table);
+
+    return box_count;
+}
+
+#endif
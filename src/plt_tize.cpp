@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <string>
+#include <vector>
+
 #include <cpp11.hpp>
+#include <cpp11/list.hpp>
 #include <cpp11/strings.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -17,7 +21,7 @@ static const int MAX_BITMAP_DIM = 100;
 static const int PALETTE_BITMAP_WIDTH = 512;
 static const int PALETTE_BITMAP_HEIGHT = 64;
 
-static void load_bitmap(Bitmap *bitmap, char *path) {
+static void load_bitmap(Bitmap *bitmap, const char *path) {
     bitmap->memory = stbi_load(path, &bitmap->width, &bitmap->height, 0, STBI_rgb_alpha);
     if (!bitmap->memory) {
         fprintf(stderr, "stb_image failed to load %s: %s\n", path, stbi_failure_reason());
@@ -27,165 +31,11 @@ static void load_bitmap(Bitmap *bitmap, char *path) {
     bitmap->pitch = sizeof(u32)*bitmap->width;
 }
 
-static void allocate_bitmap(Bitmap *bitmap, int width, int height) {
-    bitmap->memory = malloc(sizeof(u32)*width*height);
-    bitmap->width = width;
-    bitmap->height = height;
-    bitmap->pitch = sizeof(u32)*width;
-}
-
 static void free_bitmap(Bitmap *bitmap) {
     free(bitmap->memory);
     bitmap->memory = 0;
 }
 
-static void resize_bitmap(Bitmap *bitmap, int max_dim) {
-    float resize_factor = (float)max_dim / (float)maximum(bitmap->width, bitmap->height);
-
-    Bitmap resized_bitmap;
-    allocate_bitmap(&resized_bitmap,
-                    roundi(bitmap->width*resize_factor),
-                    roundi(bitmap->height*resize_factor));
-
-    int x0 = 0;
-    int x1 = resized_bitmap.width;
-    int y0 = 0;
-    int y1 = resized_bitmap.height;
-
-    u8 *row = (u8 *)resized_bitmap.memory;
-    for (int y = y0; y < y1; y++) {
-        u32 *texel = (u32 *)row;
-        for (int x = x0; x < x1; x++) {
-            float u = (float)x / ((float)resized_bitmap.width - 1.0f);
-            float v = (float)y / ((float)resized_bitmap.height - 1.0f);
-            assert(0.0f <= u && u <= 1.0f);
-            assert(0.0f <= v && v <= 1.0f);
-
-            int sample_x = roundi(u*((float)bitmap->width - 1.0f));
-            int sample_y = roundi(v*((float)bitmap->height - 1.0f));
-            assert(0 <= sample_x && sample_x < bitmap->width);
-            assert(0 <= sample_y && sample_y < bitmap->height);
-
-            u32 sample = *(u32 *)((u8 *)bitmap->memory + sample_x*sizeof(u32) + sample_y*bitmap->pitch);
-
-            *texel++ = sample;
-        }
-
-        row += resized_bitmap.pitch;
-    }
-
-    free_bitmap(bitmap);
-    *bitmap = resized_bitmap;
-}
-
-static u32 assign_observation_to_cluster(KMeans_Cluster *clusters, int cluster_count, Vector3 observation) {
-    float closest_dist_squared = FLOAT_MAX;
-    u32 closest_cluster_index = 0;
-
-    for (int i = 0; i < cluster_count; i++) {
-        KMeans_Cluster *cluster = &clusters[i];
-
-        float d = length_squared(observation - cluster->centroid);
-        if (d < closest_dist_squared) {
-            closest_dist_squared = d;
-            closest_cluster_index = (u32)i;
-        }
-    }
-    assert(0 <= closest_cluster_index && closest_cluster_index < (u32)cluster_count);
-
-    KMeans_Cluster *closest_cluster = &clusters[closest_cluster_index];
-    if (closest_cluster->observation_count == closest_cluster->observation_capacity) {
-        closest_cluster->observation_capacity *= 2;
-        closest_cluster->observations = (Vector3 *)realloc(closest_cluster->observations, sizeof(Vector3)*closest_cluster->observation_capacity);
-    }
-    closest_cluster->observations[closest_cluster->observation_count++] = observation;
-
-    return closest_cluster_index;
-}
-
-static void recalculate_cluster_centroids(KMeans_Cluster *clusters, int cluster_count) {
-    for (int i = 0; i < cluster_count; i++) {
-        KMeans_Cluster *cluster = &clusters[i];
-
-        Vector3 sum = V3i(0, 0, 0);
-        for (int j = 0; j < cluster->observation_count; j++) {
-            sum += cluster->observations[j];
-        }
-
-        // It's erroneous to assert that cluster->observation_count is nonzero,
-        // see: https://stackoverflow.com/a/54821667. Replace the zero case below
-        // with a reseed?
-
-        if (cluster->observation_count) {
-            cluster->centroid = sum*(1.0f / cluster->observation_count);
-        } else {
-            cluster->centroid = sum;
-        }
-
-        cluster->observation_count = 0;
-    }
-}
-
-static void sort_clusters_by_centroid(KMeans_Cluster *clusters, int cluster_count, Sort_Type sort_type) {
-    Vector3 focal_color = V3i(0, 0, 0);
-    switch (sort_type) {
-        case SORT_TYPE_RED:
-            focal_color = {
-              53.23288178584245f,
-              80.10930952982204f,
-              67.22006831026425f
-            };
-            break;
-
-        case SORT_TYPE_GREEN:
-            focal_color = {
-              87.73703347354422f,
-              -86.18463649762525f,
-              83.18116474777854f
-            };
-            break;
-
-        case SORT_TYPE_BLUE:
-            focal_color = {
-              32.302586667249486f,
-              79.19666178930935f,
-              -107.86368104495168f
-            };
-            break;
-    }
-
-    for (int i = 0; i < cluster_count; i++) {
-        bool swapped = false;
-
-        for (int j = 0; j < (cluster_count - 1); j++) {
-            KMeans_Cluster *cluster_a = clusters + j;
-            KMeans_Cluster *cluster_b = clusters + j + 1;
-
-            if (sort_type == SORT_TYPE_WEIGHT) {
-                if (cluster_b->observation_count > cluster_a->observation_count) {
-                    KMeans_Cluster swap = *cluster_a;
-                    *cluster_a = *cluster_b;
-                    *cluster_b = swap;
-
-                    swapped = true;
-                }
-            } else if (sort_type == SORT_TYPE_RED || sort_type == SORT_TYPE_GREEN || sort_type == SORT_TYPE_BLUE) {
-                float dist_squared_to_color_a = length_squared(cluster_a->centroid - focal_color);
-                float dist_squared_to_color_b = length_squared(cluster_b->centroid - focal_color);
-                if (dist_squared_to_color_b < dist_squared_to_color_a) {
-                    KMeans_Cluster swap = *cluster_a;
-                    *cluster_a = *cluster_b;
-                    *cluster_b = swap;
-
-                    swapped = true;
-                }
-            }
-        }
-
-        if (!swapped) break;
-    }
-}
-
 std::string color_to_hex(u32 color) {
     char hex[8];
     snprintf(hex, sizeof(hex), "#%02X%02X%02X", (color >> 0) & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF);
@@ -193,9 +43,9 @@ std::string color_to_hex(u32 color) {
 }
 
 [[cpp11::register]]
-cpp11::writable::strings plt_tize_(const std::string& source_path, int cluster_count_init, int seed, const std::string& sort_type) {
+cpp11::writable::strings plt_tize_(const std::string& source_path, int cluster_count_init, int seed, const std::string& sort_type, const std::string& method, const std::string& init, cpp11::strings init_colors, cpp11::doubles init_cielab, int init_candidates, int alpha_threshold, bool weight_by_alpha, int n_init, int batch_size, int max_dim, int sample_size, const std::string& sampling, bool pyramid, int threads, int max_iter, double tol, double change_tol, const std::string& precision, int coreset_size, bool auto_cluster_count, const std::string& k_criterion) {
     Palettize_Config config = {};
-    config.source_path = (char *)source_path.c_str();
+    config.source_path = source_path.c_str();
     config.cluster_count = cluster_count_init;
     config.seed = seed;
     if (sort_type == "weight") {
@@ -207,79 +57,267 @@ cpp11::writable::strings plt_tize_(const std::string& source_path, int cluster_c
     } else if (sort_type == "blue") {
         config.sort_type = SORT_TYPE_BLUE;
     }
+    if (method == "lloyd") {
+        config.method = CLUSTER_METHOD_LLOYD;
+    } else if (method == "hamerly") {
+        config.method = CLUSTER_METHOD_HAMERLY;
+    } else if (method == "elkan") {
+        config.method = CLUSTER_METHOD_ELKAN;
+    } else if (method == "yinyang") {
+        config.method = CLUSTER_METHOD_YINYANG;
+    } else if (method == "minibatch") {
+        config.method = CLUSTER_METHOD_MINIBATCH;
+    } else if (method == "kdtree") {
+        config.method = CLUSTER_METHOD_KDTREE;
+    } else if (method == "wu") {
+        config.method = CLUSTER_METHOD_WU;
+    } else if (method == "octree") {
+        config.method = CLUSTER_METHOD_OCTREE;
+    } else if (method == "bisecting") {
+        config.method = CLUSTER_METHOD_BISECTING;
+    }
+    if (init == "random") {
+        config.seed_method = SEED_METHOD_RANDOM;
+    } else if (init == "kmeans++") {
+        config.seed_method = SEED_METHOD_KMEANS_PLUS_PLUS;
+    } else if (init == "greedy-kmeans++") {
+        config.seed_method = SEED_METHOD_GREEDY_KMEANS_PLUS_PLUS;
+    } else if (init == "wu") {
+        config.seed_method = SEED_METHOD_WU;
+    } else if (init == "median-cut") {
+        config.seed_method = SEED_METHOD_MEDIAN_CUT;
+    } else if (init == "palette") {
+        config.seed_method = SEED_METHOD_PALETTE;
+    }
 
-    // To improve performance, source images with extents greater than MAX_BITMAP_DIM pixels are resized with nearest neighbor sampling
-    Bitmap source_bitmap;
-    load_bitmap(&source_bitmap, config.source_path);
-    if (source_bitmap.width > MAX_BITMAP_DIM || source_bitmap.height > MAX_BITMAP_DIM) {
-        resize_bitmap(&source_bitmap, MAX_BITMAP_DIM);
+    // Initial clusters come either as hex colors or as rows of L, a and b,
+    // stored column by column
+    std::vector<Vector3> initial_centroids;
+    for (int i = 0; i < init_colors.size(); i++) {
+        std::string hex = init_colors[i];
+        u32 color;
+        if (!parse_hex_color(hex.c_str(), &color)) {
+            cpp11::stop("Can't parse the initial color %s", hex.c_str());
+        }
+        initial_centroids.push_back(unpack_rgba_to_cielab(color));
+    }
+    int cielab_row_count = init_cielab.size() / 3;
+    for (int i = 0; i < cielab_row_count; i++) {
+        initial_centroids.push_back(V3((float)init_cielab[i], (float)init_cielab[cielab_row_count + i],
+                                       (float)init_cielab[2*cielab_row_count + i]));
+    }
+    config.initial_centroids = initial_centroids.data();
+    config.initial_centroid_count = (int)initial_centroids.size();
+    config.seed_candidates = init_candidates;
+    config.alpha_threshold = alpha_threshold;
+    config.weight_by_alpha = weight_by_alpha;
+    config.restart_count = n_init;
+    config.batch_size = batch_size;
+    config.max_dim = max_dim;
+    config.sample_size = sample_size;
+    if (sampling == "grid") {
+        config.sample_pattern = SAMPLE_PATTERN_GRID;
+    } else if (sampling == "stratified") {
+        config.sample_pattern = SAMPLE_PATTERN_STRATIFIED;
+    } else if (sampling == "halton") {
+        config.sample_pattern = SAMPLE_PATTERN_HALTON;
+    }
+    config.pyramid = pyramid;
+    config.thread_count = threads;
+    config.max_iterations = max_iter;
+    config.tolerance = (float)tol;
+    config.min_change_fraction = (float)change_tol;
+    config.fixed_point = (precision == "fixed");
+    config.coreset_size = coreset_size;
+    config.auto_cluster_count = auto_cluster_count;
+    if (k_criterion == "elbow") {
+        config.count_criterion = COUNT_CRITERION_ELBOW;
+    } else if (k_criterion == "silhouette") {
+        config.count_criterion = COUNT_CRITERION_SILHOUETTE;
+    } else if (k_criterion == "bic") {
+        config.count_criterion = COUNT_CRITERION_BIC;
     }
 
-    Bitmap prev_cluster_index_buffer;
-    allocate_bitmap(&prev_cluster_index_buffer, source_bitmap.width, source_bitmap.height);
+    // The octree only needs one row at a time, so when it reads every pixel of
+    // a file laid out in rows it never decodes the whole image
+    Row_Reader row_reader = {};
+    bool stream_rows = false;
+    if (config.method == CLUSTER_METHOD_OCTREE && open_row_reader(&row_reader, config.source_path)) {
+        stream_rows = reads_every_texel(row_reader.width, row_reader.height, &config);
+        if (!stream_rows) close_row_reader(&row_reader);
+    }
 
-    Random_Series entropy = seed_series(config.seed);
+    // To improve performance, source images with more than config.sample_size pixels or extents greater than config.max_dim pixels are sampled rather than read in full
+    Bitmap source_bitmap = {};
+    Bitmap_Sampler sampler = {};
+    if (!stream_rows) {
+        load_bitmap(&source_bitmap, config.source_path);
+        sampler = create_bitmap_sampler(source_bitmap, &config);
+    }
 
     int cluster_count = config.cluster_count;
     KMeans_Cluster *clusters = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count);
-    for (int i = 0; i < cluster_count; i++) {
-        KMeans_Cluster *cluster = &clusters[i];
 
-        cluster->observation_capacity = 512;
-        cluster->observation_count = 0;
-        cluster->observations = (Vector3 *)malloc(sizeof(Vector3)*cluster->observation_capacity);
+    // Bisecting k-means also returns the palette for every smaller count
+    KMeans_Cluster *nested_palettes = 0;
+    if (config.method == CLUSTER_METHOD_BISECTING && !config.auto_cluster_count) {
+        nested_palettes = (KMeans_Cluster *)malloc(sizeof(KMeans_Cluster)*cluster_count*(cluster_count + 1)/2);
+    }
 
-        // Naive cluster seeding
-        u32 sample_x = random_u32_between(&entropy, 0, (u32)(source_bitmap.width - 1));
-        u32 sample_y = random_u32_between(&entropy, 0, (u32)(source_bitmap.height - 1));
-        u32 sample = *(u32 *)get_bitmap_ptr(source_bitmap, sample_x, sample_y);
+    // With an automatic cluster count, every count up to cluster_count is
+    // scored
+    cpp11::writable::doubles k_scores(config.auto_cluster_count ? cluster_count : 0);
+    cpp11::writable::doubles k_inertias(config.auto_cluster_count ? cluster_count : 0);
+
+    // With a pyramid, the iterations of every coarser level come before the
+    // final one
+    cpp11::writable::integers level_iterations;
+
+    KMeans_Result kmeans_result;
+    double *inertias = (double *)malloc(sizeof(double)*config.restart_count);
+    if (config.method == CLUSTER_METHOD_OCTREE) {
+        // The octree reads the image a row at a time and never builds the
+        // observation buffer, so it has nothing to restart
+        if (stream_rows) {
+            kmeans_result = quantize_file_octree(clusters, cluster_count, &row_reader, config.alpha_threshold,
+                                                 config.weight_by_alpha);
+            close_row_reader(&row_reader);
+        } else {
+            kmeans_result = quantize_bitmap_octree(clusters, cluster_count, sampler, config.alpha_threshold,
+                                                   config.weight_by_alpha);
+        }
+        config.restart_count = 1;
+        inertias[0] = kmeans_result.inertia;
+    } else {
+        Observation_Buffer observations = convert_bitmap_to_cielab(sampler, config.alpha_threshold, config.weight_by_alpha);
+
+        Thread_Pool pool;
+        create_thread_pool(&pool, config.thread_count);
+
+        // The coarser levels of a pyramid leave the sampled bitmap with only polishing to do
+        Vector3 *pyramid_centroids = (Vector3 *)malloc(sizeof(Vector3)*cluster_count);
+        int pyramid_iterations[PYRAMID_MAX_LEVELS];
+        int level_count = cluster_bitmap_pyramid(pyramid_centroids, cluster_count, source_bitmap, &config, &pool,
+                                                 pyramid_iterations);
+        if (level_count > 0) {
+            for (int level = 0; level < level_count; level++) {
+                level_iterations.push_back(pyramid_iterations[level]);
+            }
+            config.seed_method = SEED_METHOD_PALETTE;
+            config.initial_centroids = pyramid_centroids;
+            config.initial_centroid_count = cluster_count;
+            config.restart_count = 1;
+        }
 
-        cluster->centroid = unpack_rgba_to_cielab(sample);
-    }
+        // A coreset stands in for the observations while clustering, and the
+        // clusters are reweighed against every observation afterwards
+        Observation_Buffer coreset = {};
+        if (config.coreset_size > 0 && observations.count > config.coreset_size) {
+            coreset = build_coreset(observations, config.coreset_size, cluster_count, config.seed, &pool);
+        }
+        Observation_Buffer clustered = coreset.l ? coreset : observations;
+
+        u8 *prev_cluster_indices = (u8 *)malloc(sizeof(u8)*clustered.count);
+
+        if (config.auto_cluster_count) {
+            double *scores = (double *)malloc(sizeof(double)*config.cluster_count);
+            double *count_inertias = (double *)malloc(sizeof(double)*config.cluster_count);
+            kmeans_result = cluster_observations_sweep(clusters, config.cluster_count, &cluster_count, scores,
+                                                       count_inertias, sampler, clustered,
+                                                       prev_cluster_indices, &config, &pool);
+            for (int k = 1; k <= config.cluster_count; k++) {
+                k_scores[k - 1] = isnan(scores[k - 1]) ? NA_REAL : scores[k - 1];
+                k_inertias[k - 1] = count_inertias[k - 1];
+            }
+            free(count_inertias);
+            free(scores);
+
+            config.restart_count = 1;
+            inertias[0] = kmeans_result.inertia;
+        } else if (config.method == CLUSTER_METHOD_BISECTING) {
+            // Bisecting spends its restarts as 2-means trials on every split
+            kmeans_result = cluster_observations_bisecting(clusters, nested_palettes, cluster_count, clustered,
+                                                           prev_cluster_indices, &config, &pool);
+            config.restart_count = 1;
+            inertias[0] = kmeans_result.inertia;
+        } else {
+            kmeans_result = cluster_observations_with_restarts(clusters, cluster_count, sampler, clustered,
+                                                               prev_cluster_indices, &config, &pool, inertias);
+        }
 
-    int x0 = 0;
-    int x1 = source_bitmap.width;
-    int y0 = 0;
-    int y1 = source_bitmap.height;
-
-    for (int iteration = 0;; iteration++) {
-        bool assignments_changed = false;
-
-        u8 *row = (u8 *)get_bitmap_ptr(source_bitmap, x0, y0);
-        u8 *prev_cluster_index_row = (u8 *)get_bitmap_ptr(prev_cluster_index_buffer, x0, y0);
-        for (int y = y0; y < y1; y++) {
-            u32 *texel = (u32 *)row;
-            u32 *prev_cluster_index_ptr = (u32 *)prev_cluster_index_row;
-            for (int x = x0; x < x1; x++) {
-                Vector3 texel_v3 = unpack_rgba_to_cielab(*texel);
-
-                u32 closest_cluster_index = assign_observation_to_cluster(clusters, cluster_count, texel_v3);
-                if (iteration > 0) {
-                    u32 prev_cluster_index = *prev_cluster_index_ptr;
-                    if (closest_cluster_index != prev_cluster_index) {
-                        assignments_changed = true;
-                    }
+        if (coreset.l) {
+            kmeans_result.inertia = measure_inertia(clusters, cluster_count, observations, &pool, true);
+            if (nested_palettes) {
+                for (int k = 1; k <= cluster_count; k++) {
+                    measure_inertia(nested_palettes + k*(k - 1)/2, k, observations, &pool, true);
                 }
-
-                texel++;
-                *prev_cluster_index_ptr++ = closest_cluster_index;
             }
+            free_observation_buffer(&coreset);
+        }
+
+        destroy_thread_pool(&pool);
 
-            row += source_bitmap.pitch;
-            prev_cluster_index_row += prev_cluster_index_buffer.pitch;
+        if (level_count > 0) {
+            level_iterations.push_back(kmeans_result.iteration_count);
         }
 
-        if (iteration == 0 || assignments_changed) recalculate_cluster_centroids(clusters, cluster_count); else break;
+        free_observation_buffer(&observations);
+        free(prev_cluster_indices);
+        free(pyramid_centroids);
+    }
+
+    cpp11::writable::doubles restart_inertias(config.restart_count);
+    for (int i = 0; i < config.restart_count; i++) {
+        restart_inertias[i] = inertias[i];
     }
+    free(inertias);
 
     sort_clusters_by_centroid(clusters, cluster_count, config.sort_type);
 
-    cpp11::writable::strings palette_hex(config.cluster_count);
-    for (int i = 0; i < config.cluster_count; i++) {
+    double total_weight = 0.0;
+    for (int i = 0; i < cluster_count; i++) {
+        total_weight += clusters[i].observation_weight;
+    }
+
+    cpp11::writable::strings palette_hex(cluster_count);
+    cpp11::writable::doubles weights(cluster_count);
+    for (int i = 0; i < cluster_count; i++) {
         KMeans_Cluster *cluster = &clusters[i];
         u32 color = pack_cielab_to_rgba(cluster->centroid);
         palette_hex[i] = color_to_hex(color);
+        weights[i] = (total_weight > 0.0) ? cluster->observation_weight / total_weight : 0.0;
+    }
+    palette_hex.attr("weights") = weights;
+    palette_hex.attr("iterations") = kmeans_result.iteration_count;
+    palette_hex.attr("converged") = kmeans_result.converged;
+    palette_hex.attr("inertia") = kmeans_result.inertia;
+    palette_hex.attr("restart_inertias") = restart_inertias;
+    if (config.auto_cluster_count) {
+        palette_hex.attr("cluster_count") = cluster_count;
+        palette_hex.attr("k_scores") = k_scores;
+        palette_hex.attr("k_inertias") = k_inertias;
     }
+    if (level_iterations.size() > 0) {
+        palette_hex.attr("level_iterations") = level_iterations;
+    }
+    if (nested_palettes) {
+        cpp11::writable::list palettes(cluster_count);
+        for (int k = 1; k <= cluster_count; k++) {
+            KMeans_Cluster *palette = nested_palettes + k*(k - 1)/2;
+            sort_clusters_by_centroid(palette, k, config.sort_type);
+
+            cpp11::writable::strings hex(k);
+            for (int i = 0; i < k; i++) {
+                hex[i] = color_to_hex(pack_cielab_to_rgba(palette[i].centroid));
+            }
+            palettes[k - 1] = hex;
+        }
+        palette_hex.attr("palettes") = palettes;
+        free(nested_palettes);
+    }
+
+    free(clusters);
+    free_bitmap(&source_bitmap);
 
     return palette_hex;
 }